@@ -5,9 +5,59 @@
 #include <string.h>
 #include <pthread.h>
 #include <netdb.h>
+#include <time.h>
+#include <errno.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #define BUFFER_SIZE 2048
 #define HASH_SPACE 1024
+// Default per node memory budget for key and value bytes. Can be overridden on the command line.
+#define DEFAULT_MEMORY_BUDGET (HASH_SPACE * 64)
+// Timing wheel geometry. One tick is one second. Level 0 covers WHEEL_SLOTS seconds,
+// level 1 covers WHEEL_SLOTS * WHEEL_SLOTS seconds. Longer TTLs wait in level 1 and are re-filed as it cascades.
+#define WHEEL_SLOTS 64
+#define WHEEL_LEVELS 2
+// Longest TTL accepted, ten years. Keeps currentTick + ttl and time(NULL) + ttl from overflowing.
+#define MAX_TTL (10UL * 365 * 24 * 60 * 60)
+// Load rebalancing. Every REBALANCE_INTERVAL seconds a node compares its request load with its successor's
+// and hands the hottest top part of its range over when it is more than HOT_FACTOR times as loaded.
+// Loads below MIN_HOT_LOAD are never worth moving. Hit counters are halved every interval.
+#define REBALANCE_INTERVAL 10
+#define HOT_FACTOR 2
+#define MIN_HOT_LOAD 64
+// Failure detection. Every HEARTBEAT_INTERVAL_MS a node pings its successor, which answers with its successor list.
+// A successor that drops the connection, or misses MISSED_HEARTBEATS replies in a row, is taken as dead
+// and skipped for the next live node in the list, which is SUCCESSOR_LIST_SIZE long.
+#define HEARTBEAT_INTERVAL_MS 200
+#define MISSED_HEARTBEATS 3
+#define SUCCESSOR_LIST_SIZE 3
+// Connects to a node we think is dead are tried CONNECT_ATTEMPTS times, CONNECT_RETRY_MS apart, before giving up on it.
+#define CONNECT_ATTEMPTS 3
+#define CONNECT_RETRY_MS 50
+// Batch mode. Up to MAX_IN_FLIGHT batch commands are out around the ring at once.
+// A batch gives up on replies that haven't come in after BATCH_REPLY_TIMEOUT seconds without any progress.
+#define MAX_IN_FLIGHT 64
+#define BATCH_REPLY_TIMEOUT 5
+// Seconds a node taking a range over can go without answering before the handover is called off.
+#define HANDOVER_TIMEOUT 5
+// Request deadlines and hedging. Requests sent around the ring carry how long they have left, DEFAULT_DEADLINE_MS
+// when they are typed in, and any node getting one with nothing left drops it. A lookup still unanswered after the
+// hedge percentile of recent request latencies gets a second copy sent by another route.
+// Until LATENCY_MIN_SAMPLES latencies are in, DEFAULT_HEDGE_DELAY_US is used instead.
+#define DEFAULT_DEADLINE_MS 1000
+#define DEFAULT_HEDGE_PERCENTILE 95
+#define DEFAULT_HEDGE_DELAY_US 50000
+#define LATENCY_SAMPLES 256
+#define LATENCY_MIN_SAMPLES 20
+// Replies between working the hedge delay out again.
+#define HEDGE_UPDATE_INTERVAL 16
+// Requests sent around the ring that this node is waiting on at once.
+#define MAX_PENDING 256
+// Most nodes dump and import will handle in one ring.
+#define MAX_RING_NODES 128
 
 // Range[1] will be the id. range 0 will be predecessor id + 1
 int range[2];
@@ -21,6 +71,67 @@ int socketFD;
 // The hash space to store all the values.
 char *values[HASH_SPACE];
 
+// Bytes of keys and values currently held in values[] and the most this node is allowed to hold.
+size_t memoryUsed = 0;
+size_t memoryBudget = DEFAULT_MEMORY_BUDGET;
+
+// CLOCK eviction state. A key's referenced bit is set whenever it is read or written
+// and cleared when the hand sweeps past it, so only keys untouched for a full sweep are evicted.
+char referenced[HASH_SPACE];
+int clockHand = 0;
+
+// Memory counters reported by the stats command.
+unsigned long evictionCount = 0;
+unsigned long pressureCount = 0;
+unsigned long rejectedCount = 0;
+unsigned long expiredCount = 0;
+
+// Hierarchical timing wheel for key expiry.
+// expiresAt[key] is the tick the key expires on, 0 if it never expires.
+// Every key with a TTL sits in exactly one wheel slot, linked through timerNext/timerPrev (-1 ends a list).
+// timerSlot[key] is the index into wheel[] of that slot, -1 if the key is not scheduled.
+unsigned long currentTick = 0;
+unsigned long expiresAt[HASH_SPACE];
+// Wall clock second each key with a TTL expires at, 0 if it never expires. Only used in the Merkle leaf hash,
+// where ticks can't be compared because every node started its wheel at a different time.
+time_t expiryStamp[HASH_SPACE];
+int wheel[WHEEL_LEVELS * WHEEL_SLOTS];
+int timerNext[HASH_SPACE];
+int timerPrev[HASH_SPACE];
+int timerSlot[HASH_SPACE];
+
+// Merkle tree over the hash space, used to send only the keys that differ when a range changes hands.
+// merkle[1] is the root, node n has children 2n and 2n + 1, and key k's leaf is merkle[HASH_SPACE + k].
+// Empty leaves and subtrees hash to 0.
+unsigned long long merkle[2 * HASH_SPACE];
+
+// Range sync counters reported by the stats command.
+unsigned long syncKeysSent = 0;
+unsigned long syncSubtreesSkipped = 0;
+
+// Range currently being migrated to another node, migrateLo is -1 when there is none.
+// We keep owning and serving it until the handover flips, and every write to it is
+// applied here and forwarded to the new owner on migrateFD.
+int migrateLo = -1;
+int migrateHi = -1;
+int migrateFD = -1;
+pthread_mutex_t migrateLock = PTHREAD_MUTEX_INITIALIZER;
+unsigned long migratedWrites = 0;
+
+// Guards values[] and the memory accounting above.
+pthread_mutex_t valuesLock = PTHREAD_MUTEX_INITIALIZER;
+
+// Held while this node's range is being handed to a joining node or to our successor on exit.
+pthread_mutex_t rangeLock = PTHREAD_MUTEX_INITIALIZER;
+
+// Held shared by every write to a key we own, and exclusively while a range boundary moves,
+// so writes cannot slip in between the last sync of a range and its handover.
+pthread_rwlock_t ownershipLock = PTHREAD_RWLOCK_INITIALIZER;
+
+// Requests served per key, halved every REBALANCE_INTERVAL so it tracks the recent request rate.
+unsigned long hits[HASH_SPACE];
+unsigned long rangeShifts = 0;
+
 // Predecessor Information
 char predecessorAddress[INET_ADDRSTRLEN];
 int predecessorPort;
@@ -31,16 +142,118 @@ char successorAddress[INET_ADDRSTRLEN];
 int successorPort;
 int successorFD;
 
+// The next SUCCESSOR_LIST_SIZE nodes after us, starting with our successor, learnt from heartbeat replies.
+// Their ids let a hedged request jump straight to the node that should own its key.
+typedef struct
+{
+    int id;
+    char address[INET_ADDRSTRLEN];
+    int port;
+} nodeAddressStruct;
+nodeAddressStruct successorList[SUCCESSOR_LIST_SIZE];
+int successorListCount = 0;
+// 1 when the list runs all the way round the ring back to us, so nobody we don't know of lies past its end.
+int successorListWraps = 0;
+unsigned long failoverCount = 0;
+
+// Forwards that fail wake the heartbeat thread through heartbeatCond so it checks the successor right away,
+// then wait on failoverCond for it to be replaced.
+pthread_mutex_t heartbeatLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t heartbeatCond = PTHREAD_COND_INITIALIZER;
+pthread_cond_t failoverCond = PTHREAD_COND_INITIALIZER;
+int successorSuspect = 0;
+
+// Batch commands sent out that haven't had their result printed yet.
+int inFlight = 0;
+pthread_mutex_t batchLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t batchCond = PTHREAD_COND_INITIALIZER;
+
+// Requests from this node out around the ring, waiting on their results. A request's slot is its id modulo MAX_PENDING.
+// Ids start at 1 and a free slot has id 0. message is only kept for lookups, the only requests we hedge.
+typedef struct
+{
+    unsigned long id;
+    int tag;
+    int key;
+    int hedged;
+    unsigned long long sentAt;
+    unsigned long long deadline;  // nowMicros() time we give up on it at
+    char message[BUFFER_SIZE];
+} pendingRequestStruct;
+pendingRequestStruct pending[MAX_PENDING];
+unsigned long nextRequestID = 1;
+int pendingCount = 0;
+pthread_mutex_t pendingLock = PTHREAD_MUTEX_INITIALIZER;
+// Wakes the hedge thread when a request starts being tracked or becomes hedgeable.
+pthread_cond_t pendingCond = PTHREAD_COND_INITIALIZER;
+
+// Latencies in microseconds of the last LATENCY_SAMPLES requests answered, and the hedge delay worked out from them.
+unsigned long long latencies[LATENCY_SAMPLES];
+int latencyCount = 0;
+int latencyNext = 0;
+int latenciesSinceUpdate = 0;
+unsigned long long hedgeDelay = DEFAULT_HEDGE_DELAY_US;
+int hedgePercentile = DEFAULT_HEDGE_PERCENTILE;
+unsigned long deadlineMillis = DEFAULT_DEADLINE_MS;
+
+// Connection hedged copies go out on, kept apart from successorFD so they don't queue behind it.
+int hedgeFD = -1;
+char hedgeAddress[INET_ADDRSTRLEN];
+int hedgePort = -1;
+
+// Deadline and hedging counters reported by the stats command.
+unsigned long hedgesSent = 0;
+unsigned long duplicateReplies = 0;
+unsigned long expiredDropped = 0;
+unsigned long timedOutRequests = 0;
+
+// This node's address, looked up once at startup. get_local_ip returns it through static
+// resolver buffers, so it must not be called from the connection threads.
+char myIP[INET_ADDRSTRLEN]; // INET_ADDRSTRLEN = 16 bytes, enough for IPv4 string
+
 // Bootstrap Information [Used by normal nameservers]
 char bootstrapAddress[INET_ADDRSTRLEN];
 int bootstrapPort;
-int bootstrapFD;
+
+// 1 while this node is part of the ring and can serve client commands.
+int inRing = 0;
 
 typedef struct
 {
     int fd;
 } clientDataStruct;
 
+// Connections to the nodes client commands came from, kept open to send their results back on.
+#define MAX_RESULT_CONNECTIONS 64
+typedef struct
+{
+    char address[INET_ADDRSTRLEN];
+    int port;
+    int fd;
+} resultConnectionStruct;
+resultConnectionStruct resultConnections[MAX_RESULT_CONNECTIONS];
+
+int resultConnectionCount = 0;
+pthread_mutex_t resultLock = PTHREAD_MUTEX_INITIALIZER;
+
+// One node of the ring as seen by dump and import, with the record lines going to or coming from it.
+typedef struct
+{
+    int lo;
+    int hi;
+    char address[INET_ADDRSTRLEN];
+    int port;
+    char *data;
+    size_t length;
+    size_t capacity;
+    int count;
+    int skipped;
+    // What the node reported doing with the records imported into it
+    int stored;
+    int forwarded;
+    int failed;
+} ringNodeStruct;
+
 // copies local ip to the passed in char*
 // Retrieves the local machine's IP address and stores it in ip_buffer.
 // ip_buffer must be at least INET_ADDRSTRLEN bytes.
@@ -106,7 +319,7 @@ int open_socket(int port)
     return openSocketFD;
 }
 
-// Connects to the port at address and returns the connectionFD.
+// Connects to the port at address and returns the connectionFD, -1 if nothing is listening there.
 int create_connection(char *address, int port)
 {
     int connectionFD = socket(AF_INET, SOCK_STREAM, 0);
@@ -125,434 +338,2682 @@ int create_connection(char *address, int port)
     if (connect(connectionFD, (struct sockaddr *)&sockaddr, sizeof(sockaddr)) < 0)
     {
         perror("Create Connection Fail");
-        exit(EXIT_FAILURE);
+        close(connectionFD);
+        return -1;
     }
     return connectionFD;
 }
 
-// Inserts the key value pair iff key in range
-void insert(int key, char *value)
+// Sends length bytes of message on fd as one message.
+// Every message goes out behind its length, so messages sent back to back are read back one at a time.
+// Header and body go in a single write so threads sharing a connection don't interleave.
+// Messages longer than a receiver's buffer are refused rather than cut, since cutting drops the fields at the end.
+// Returns -1 with errno set to EMSGSIZE for those.
+int sendMessage(int fd, char *message, size_t length)
 {
-    values[key] = (char *)calloc(BUFFER_SIZE, sizeof(char));
-    if (values[key] == NULL)
+    char frame[BUFFER_SIZE + sizeof(uint32_t)];
+    if (length > BUFFER_SIZE - 1)
     {
-        perror("Memory allocation failed");
-        exit(EXIT_FAILURE);
+        printf("Message too long to send: %zu bytes\n", length);
+        errno = EMSGSIZE;
+        return -1;
     }
-    strcpy(values[key], value);
+    uint32_t header = htonl(length);
+    memcpy(frame, &header, sizeof(header));
+    memcpy(frame + sizeof(header), message, length);
+    return write(fd, frame, sizeof(header) + length);
 }
 
-// Deletes the value at key if key in range AND there is a value associated to key.
-// Frees the memory at key and marks key as empty
-void delete(int key)
+// Reads exactly length bytes from fd. Returns 0 if the connection closed or failed first.
+int readFully(int fd, char *buffer, size_t length)
 {
-    if (values[key] == NULL)
+    size_t done = 0;
+    while (done < length)
     {
-        return;
+        int readAmount = read(fd, buffer + done, length - done);
+        if (readAmount <= 0)
+        {
+            return 0;
+        }
+        done += readAmount;
     }
-    free(values[key]);
-    values[key] = NULL;
+    return 1;
 }
 
-// handles all non bootstrap messages passed to nodes in the ring
-void *messageHandler(void *arg)
+// Reads one message from fd into buffer and null terminates it. Returns the amount read, 0 if the connection closed.
+int readMessage(int fd, char *buffer)
 {
-    // printf("Here in message handler\n");
-    clientDataStruct *newClientStruct = (clientDataStruct *)arg;
+    uint32_t header;
+    buffer[0] = '\0';
+    if (!readFully(fd, (char *)&header, sizeof(header)))
+    {
+        return 0;
+    }
+    size_t length = ntohl(header);
+    if (length > BUFFER_SIZE - 1 || !readFully(fd, buffer, length))
+    {
+        return 0;
+    }
+    buffer[length] = '\0';
+    return length;
+}
 
-    // clientFD is the PREDECESSOR FD
-    int clientFD = newClientStruct->fd;
-    char inputBuffer[BUFFER_SIZE];
-    while (1)
+// Bytes charged against the memory budget for holding value under a key.
+size_t entrySize(char *value)
+{
+    return sizeof(int) + strlen(value) + 1;
+}
+
+// Unlinks key from whatever wheel slot it is in.
+// Caller must hold valuesLock.
+void unscheduleExpiry(int key)
+{
+    if (timerSlot[key] < 0)
     {
-        int readAmount = 0;
-        // WE CAN'T READ CLIENT FD ONCE WE CHANGE PREDECESSOR
-        readAmount = read(clientFD, inputBuffer, BUFFER_SIZE);
-        inputBuffer[readAmount] = '\0';
-        if (readAmount == 0)
+        return;
+    }
+    if (timerPrev[key] >= 0)
+    {
+        timerNext[timerPrev[key]] = timerNext[key];
+    }
+    else
+    {
+        wheel[timerSlot[key]] = timerNext[key];
+    }
+    if (timerNext[key] >= 0)
+    {
+        timerPrev[timerNext[key]] = timerPrev[key];
+    }
+    timerSlot[key] = -1;
+    timerNext[key] = -1;
+    timerPrev[key] = -1;
+}
+
+// Files key into the wheel slot for expiresAt[key] relative to the current tick.
+// Caller must hold valuesLock.
+void scheduleExpiry(int key)
+{
+    unsigned long expires = expiresAt[key];
+    int slot;
+    if (expires <= currentTick)
+    {
+        slot = currentTick % WHEEL_SLOTS;
+    }
+    else if (expires - currentTick < WHEEL_SLOTS)
+    {
+        slot = expires % WHEEL_SLOTS;
+    }
+    else
+    {
+        // Level 1 slots cascade once every WHEEL_SLOTS ticks. TTLs past the end of
+        // level 1 park in the slot that cascades last and get re-filed from there.
+        unsigned long block = expires / WHEEL_SLOTS;
+        unsigned long lastBlock = currentTick / WHEEL_SLOTS + WHEEL_SLOTS;
+        if (block > lastBlock)
         {
-            printf("in readAmount = 0\n");
-            pthread_exit(0);
+            block = lastBlock;
         }
-        char command[BUFFER_SIZE];
-        sscanf(inputBuffer, "%s", command);
-        printf("%s\n", inputBuffer);
-        
-        if (strcmp("enter", command) == 0)
-        {
-            // THE BOOTSTRAP SERVER IS THE ONLY RECEIVER OF THIS COMMAND.
-            //  gets id, port, address
-            int id, port2;
-            char address[INET_ADDRSTRLEN];
-            sscanf(inputBuffer, "%*s %d %d %s", &id, &port2, address);
-            if (id == 0 || id >= range[0])
-            {
-                printf("Id %d in range %d %d\n", id, range[0], range[1]);
-                
-                // if in range send successor, predecessor, range info, traversed list, and key values in range
-                char traversedList[BUFFER_SIZE] = "0";
-                char message[BUFFER_SIZE];
-                char myIP[INET_ADDRSTRLEN]; // INET_ADDRSTRLEN = 16 bytes, enough for IPv4 string
-                get_local_ip(myIP);
-                snprintf(message, sizeof(message), "entered %d %s %d %s %d %s ", successorPort, successorAddress, port, myIP, range[0], traversedList);
+        slot = WHEEL_SLOTS + block % WHEEL_SLOTS;
+    }
+    timerSlot[key] = slot;
+    timerPrev[key] = -1;
+    timerNext[key] = wheel[slot];
+    if (wheel[slot] >= 0)
+    {
+        timerPrev[wheel[slot]] = key;
+    }
+    wheel[slot] = key;
+}
+
+// Returns 1 if key falls in this node's range. The bootstrap's range wraps past the end of the hash space.
+// A node that is not in the ring, or has not yet taken over its range, owns nothing.
+int inRange(int key)
+{
+    if (!inRing)
+    {
+        return 0;
+    }
+    if (range[0] <= range[1])
+    {
+        return range[0] <= key && key <= range[1];
+    }
+    return key >= range[0] || key <= range[1];
+}
 
-                // update predecessor and successor info
+// Sum of the recent request counts over the keys in our range.
+unsigned long nodeLoad()
+{
+    unsigned long load = 0;
+    for (int i = 0; i < HASH_SPACE; i++)
+    {
+        if (inRange(i))
+        {
+            load += hits[i];
+        }
+    }
+    return load;
+}
 
-                // Writes to the current PREDECESSOR it needs to update its SUCCESSOR to the NEW NODE
-                char m2[BUFFER_SIZE];
-                snprintf(m2, sizeof(m2), "%s %d %s", "updateSuccessor", port2, address);
-                write(predecessorFD, m2, strlen(m2));
+// Recomputes the Merkle leaf for key and every hash on its path to the root.
+// Caller must hold valuesLock.
+void updateMerkle(int key)
+{
+    int node = HASH_SPACE + key;
+    merkle[node] = 0;
+    if (values[key] != NULL)
+    {
+        // FNV-1a over the key, value and expiry, so a copy with a stale TTL doesn't compare the same
+        unsigned long long hash = 14695981039346656037ULL;
+        hash = (hash ^ (unsigned long long)key) * 1099511628211ULL;
+        for (char *c = values[key]; *c != '\0'; c++)
+        {
+            hash = (hash ^ (unsigned char)*c) * 1099511628211ULL;
+        }
+        hash = (hash ^ (unsigned long long)expiryStamp[key]) * 1099511628211ULL;
+        merkle[node] = hash == 0 ? 1 : hash;
+    }
 
-                predecessorPort = port2;
-                strcpy(predecessorAddress, address);
-                predecessorFD = create_connection(address, port2);
+    for (node /= 2; node >= 1; node /= 2)
+    {
+        unsigned long long left = merkle[2 * node];
+        unsigned long long right = merkle[2 * node + 1];
+        if (left == 0 && right == 0)
+        {
+            merkle[node] = 0;
+        }
+        else
+        {
+            unsigned long long hash = (left ^ 14695981039346656037ULL) * 1099511628211ULL;
+            hash = (hash ^ right) * 1099511628211ULL;
+            merkle[node] = hash == 0 ? 1 : hash;
+        }
+    }
+}
 
-                char temp[10];
-                read(predecessorFD, temp, sizeof(temp));
-                
-                if (strcmp(temp, "ack") != 0)
-                {
-                    printf("%s\n", temp);
-                    printf("uh oh\n");
-                    return NULL;
-                }
+// Seconds key has left to live, 0 if it has no TTL.
+unsigned long remainingTTL(int key)
+{
+    if (expiresAt[key] == 0 || expiresAt[key] <= currentTick)
+    {
+        return 0;
+    }
+    return expiresAt[key] - currentTick;
+}
 
-                write(predecessorFD, message, strlen(message));
+// Frees the value at key and takes it off the memory accounting.
+// Caller must hold valuesLock.
+void removeValue(int key)
+{
+    if (values[key] == NULL)
+    {
+        return;
+    }
+    unscheduleExpiry(key);
+    expiresAt[key] = 0;
+    expiryStamp[key] = 0;
+    memoryUsed -= entrySize(values[key]);
+    free(values[key]);
+    values[key] = NULL;
+    referenced[key] = 0;
+    updateMerkle(key);
+}
 
-                // pass along all key values in CURRENT NODE'S RANGE
-                for (int i = range[0]; i <= id; i++)
-                {
-                    if (values[i] != NULL)
-                    {
-                        char insertMessage[BUFFER_SIZE];
-                        char checkBuf[BUFFER_SIZE];
-                        memset(checkBuf, 0, BUFFER_SIZE);
-                        snprintf(insertMessage, sizeof(insertMessage), "%d %s", i, values[i]);
-                        write(predecessorFD, insertMessage, strlen(insertMessage));
-                        read(predecessorFD, checkBuf, BUFFER_SIZE);
-                        if(strcmp(checkBuf, "ack") != 0){
-                            
-                            printf("an error occured\n");
-                        }
-                        delete (i);
-                    }
-                }
-                write(predecessorFD, "EOF", strlen("EOF"));
-                
-                range[0] = id + 1;  
-                printf("RANGE: %d\n", range[0]);
+// Sweeps the clock hand over the hash space evicting keys that have not been referenced
+// since the last sweep until needed more bytes fit in the budget. The key keep is never evicted.
+// Caller must hold valuesLock.
+void evict(size_t needed, int keep)
+{
+    size_t kept = values[keep] != NULL ? entrySize(values[keep]) : 0;
+    while (memoryUsed > kept && memoryUsed + needed > memoryBudget)
+    {
+        if (values[clockHand] != NULL && clockHand != keep)
+        {
+            // Copies kept from ranges handed to other nodes go first
+            if (referenced[clockHand] && inRange(clockHand))
+            {
+                referenced[clockHand] = 0;
             }
             else
             {
-                // pass this message along to the successor
-                // add current server id to the traversed server id list
-                char traversedList[BUFFER_SIZE] = "0";
-                char command2[BUFFER_SIZE] = "entering";
-                char message[BUFFER_SIZE];
-                // send entering
-                snprintf(message, sizeof(message), "%s %d %d %s %s", command2, id, port2, address, traversedList);
-                write(successorFD, message, strlen(message));
+                removeValue(clockHand);
+                evictionCount++;
             }
         }
-        else if (strcmp("entering", command) == 0)
-        {
-            //  gets id, port, address
-            int id, port2;
-            char address[INET_ADDRSTRLEN];
-            char traversedList[BUFFER_SIZE];
-            sscanf(inputBuffer, "%*s %d %d %s", &id, &port2, address, traversedList);
-            char *traversedListStart = strstr(inputBuffer, address) + strlen(address) + 1;
-            strncpy(traversedList, traversedListStart, BUFFER_SIZE - 1);
-            traversedList[BUFFER_SIZE - 1] = '\0';
-            snprintf(traversedList, BUFFER_SIZE, "%s,%d", traversedList, range[1]);
-            if (range[0] <= id && id <= range[1])
-            {
-                // if in range send successor, predecessor, range info, traversed list, and key values in range
-                char message[BUFFER_SIZE];
-                char myIP[INET_ADDRSTRLEN]; // INET_ADDRSTRLEN = 16 bytes, enough for IPv4 string
-                get_local_ip(myIP);
-                snprintf(message, sizeof(message), "entered %d %s %d %s %d %s ", predecessorPort, predecessorAddress, port, myIP, range[0], traversedList);
-
-                // update predecessor and successor info
-
-                // Writes to the current predecessor to update its successor to the NEW NODE
-                char m2[BUFFER_SIZE];
-                snprintf(m2, sizeof(m2), "%s %d %s", "updateSuccessor", port2, address);
-                write(predecessorFD, m2, strlen(m2));
-
-                predecessorPort = port2;
-                strcpy(predecessorAddress, address);
-                predecessorFD = create_connection(address, port2);
-
-                char temp[10];
-                read(predecessorFD, temp, sizeof(temp));
-                printf("read\n");
-                
-                if (strcmp(temp, "ack") != 0)
-                {
-                    printf("%s\n", temp);
-                    printf("uh oh\n");
-                    return (void *)NULL;
-                }
+        clockHand = (clockHand + 1) % HASH_SPACE;
+    }
+}
 
-                write(predecessorFD, message, strlen(message));
-                printf("wrote message\n");
-                // pass along all key values in successors range
-                for (int i = range[0]; i <= id; i++)
-                {
-                    if (values[i] != NULL)
-                    {
-                        char insertMessage[BUFFER_SIZE];
-                        snprintf(insertMessage, sizeof(insertMessage), "%d %s", i, values[i]);
-                        write(predecessorFD, insertMessage, strlen(insertMessage));
-                        delete (i);
-                        read(predecessorFD, insertMessage, BUFFER_SIZE);
-                        if(strcmp(insertMessage, "ack") != 0){
-                            printf("an error occured\n");
-                        }
-                    }
-                }
-                write(predecessorFD, "EOF", strlen("EOF"));
+// Stores the key value pair, expiring ttl ticks from now with stamp as its wall clock expiry. Both are 0 for no TTL.
+// Evicts least recently used keys when the memory budget would be exceeded.
+// Returns 0 on success, -1 if the value could not be stored.
+int storeValue(int key, char *value, unsigned long ttl, time_t stamp)
+{
+    size_t size = entrySize(value);
+    if (size > memoryBudget)
+    {
+        // Can never fit, leave whatever is stored at key alone
+        rejectedCount++;
+        return -1;
+    }
+    char *copy = (char *)malloc(strlen(value) + 1);
+    if (copy == NULL)
+    {
+        perror("Memory allocation failed");
+        rejectedCount++;
+        return -1;
+    }
+    strcpy(copy, value);
 
-                range[0] = id + 1;
-            }
-            else
-            {
-                // pass this message along to the successor
-                // add current server id to the traversed server id list
-                char command2[BUFFER_SIZE] = "entering";
-                char message[BUFFER_SIZE];
-                snprintf(message, sizeof(message), "%s %d %d %s %s", command2, id, port2, address, traversedList);
-                write(successorFD, message, strlen(message));
-            }
-        } // entering
-        else if (strcmp("entered", command) == 0)
-        {
-            int sPort, pPort, rStart;
-            char sAddress[INET_ADDRSTRLEN], pAddress[INET_ADDRSTRLEN], traversedList[BUFFER_SIZE];
-            sscanf(inputBuffer, "%*s %d %s %d %s %d %s", &pPort, pAddress, &sPort, sAddress, &rStart, traversedList);
-            // update predecessor and successor info
-            successorPort = sPort;
-            strcpy(successorAddress, sAddress);
-            predecessorPort = pPort;
-            strcpy(predecessorAddress, pAddress);
-            successorFD = create_connection(successorAddress, successorPort);
-            range[0] = rStart;
+    pthread_mutex_lock(&valuesLock);
+    // The old value at key is replaced, so only the growth has to be made room for
+    size_t oldSize = values[key] != NULL ? entrySize(values[key]) : 0;
+    if (memoryUsed - oldSize + size > memoryBudget)
+    {
+        pressureCount++;
+        evict(size - oldSize, key);
+    }
 
-            // insert all key values from SUCCESSOR
-            int going = 1;
-            readAmount = read(successorFD, inputBuffer, BUFFER_SIZE);
-            if(inputBuffer[0] == 'E' && inputBuffer[1] == 'O' && inputBuffer[2] == 'F') going = 0;
-            while (going == 1)
-            {
-                char valBuf[BUFFER_SIZE];
-                int key;
-                char value[BUFFER_SIZE];
-                sscanf(valBuf, "%d %s", &key, value);
-                printf("%d %s\n", key, value);
-                insert(key, value);
-                write(successorFD, "ack", strlen("ack"));
-                memset(valBuf, 0, BUFFER_SIZE);
-                readAmount = read(successorFD, valBuf, BUFFER_SIZE);
-                if(strcmp("EOF", valBuf) == 0) going = 0;
-            }
+    removeValue(key);
+    values[key] = copy;
+    memoryUsed += size;
+    referenced[key] = 1;
+    if (ttl > 0)
+    {
+        expiresAt[key] = currentTick + ttl;
+        expiryStamp[key] = stamp;
+        scheduleExpiry(key);
+    }
+    updateMerkle(key);
+    pthread_mutex_unlock(&valuesLock);
+    return 0;
+}
 
-            // all prints
-            printf("successful entry\n");
-            printf("Range: [%d, %d]\n", range[0], range[1]);
-            write(successorFD, "getID", strlen("getID"));
-            readAmount = read(successorFD, inputBuffer, BUFFER_SIZE);
-            inputBuffer[readAmount] = '\0';
-            int id;
-            sscanf(inputBuffer, "%d", &id);
-            write(predecessorFD, "getID", strlen("getID"));
-            readAmount = read(predecessorFD, inputBuffer, BUFFER_SIZE);
-            inputBuffer[readAmount] = '\0';
-            int id2;
-            sscanf(inputBuffer, "%d", &id2);
-            printf("Predecessor ID: %d\n", id2);
-            printf("Sucessor ID: %d\n", id);
-            printf("Traversed: %s\n", traversedList);
-        } // entered
-        else if (strcmp("getID", command) == 0)
+// Inserts the key value pair iff key in range
+// The key expires after ttl seconds, or never if ttl is 0.
+// Returns 0 on success, -1 if the value could not be stored.
+int insert(int key, char *value, unsigned long ttl)
+{
+    if (ttl > MAX_TTL)
+    {
+        ttl = MAX_TTL;
+    }
+    return storeValue(key, value, ttl, ttl > 0 ? time(NULL) + ttl : 0);
+}
+
+// Inserts a key handed over by another node along with the wall clock second it expires at, 0 for never.
+// The stamp is stored as sent rather than rebuilt from a TTL, so the Merkle leaves on both nodes agree.
+int insertStamped(int key, char *value, time_t stamp)
+{
+    unsigned long ttl = 0;
+    if (stamp != 0)
+    {
+        // Already past it here, let the next tick expire it
+        time_t now = time(NULL);
+        ttl = stamp > now ? (unsigned long)(stamp - now) : 1;
+        if (ttl > MAX_TTL)
         {
-            char message[BUFFER_SIZE];
-            snprintf(message, sizeof(message), "%d", range[1]);
-            write(clientFD, message, strlen(message));
+            ttl = MAX_TTL;
         }
-        else if (strcmp("updatePredecessor", command) == 0)
+    }
+    return storeValue(key, value, ttl, stamp);
+}
+
+// Returns 1 if there is a live value at key. Drops the value first if its TTL has passed.
+int hasValue(int key)
+{
+    if (values[key] != NULL && expiresAt[key] != 0 && expiresAt[key] <= currentTick)
+    {
+        pthread_mutex_lock(&valuesLock);
+        if (values[key] != NULL && expiresAt[key] != 0 && expiresAt[key] <= currentTick)
         {
-            int pPort;
-            char pAddress[INET_ADDRSTRLEN];
-            sscanf(inputBuffer, "%*s %d %s", &pPort, pAddress);
-            predecessorPort = pPort;
-            strcpy(predecessorAddress, pAddress);
-            struct sockaddr_in clientAddr;
-            socklen_t clientAddrlen = sizeof(clientAddr);
-            if ((predecessorFD = accept(socketFD, (struct sockaddr *)&clientAddr, &clientAddrlen)) < 0)
-            {
-                perror("Accept failed");
-                exit(EXIT_FAILURE);
-            }
+            removeValue(key);
+            expiredCount++;
         }
-        else if (strcmp("updateSuccessor", command) == 0)
+        pthread_mutex_unlock(&valuesLock);
+    }
+    return values[key] != NULL;
+}
+
+// Copies the value at key into buffer, which must hold BUFFER_SIZE bytes, and marks the key as recently used.
+// The copy is taken under valuesLock so an eviction or expiry can't free the value while it is read.
+// Returns 1 if there was a value, 0 if there is none.
+int getValue(int key, char *buffer)
+{
+    if (!hasValue(key))
+    {
+        return 0;
+    }
+    pthread_mutex_lock(&valuesLock);
+    int found = values[key] != NULL;
+    if (found)
+    {
+        snprintf(buffer, BUFFER_SIZE, "%s", values[key]);
+        referenced[key] = 1;
+    }
+    pthread_mutex_unlock(&valuesLock);
+    return found;
+}
+
+// Deletes the value at key if key in range AND there is a value associated to key.
+// Frees the memory at key and marks key as empty
+// The deleted value is copied into buffer first if buffer is not NULL. Returns 1 if there was a value.
+int delete(int key, char *buffer)
+{
+    hasValue(key);
+    pthread_mutex_lock(&valuesLock);
+    int found = values[key] != NULL;
+    if (found && buffer != NULL)
+    {
+        snprintf(buffer, BUFFER_SIZE, "%s", values[key]);
+    }
+    removeValue(key);
+    pthread_mutex_unlock(&valuesLock);
+    return found;
+}
+
+// Advances the timing wheel one tick, cascading level 1 when level 0 wraps and
+// expiring every key filed in the new level 0 slot.
+void expiryTick()
+{
+    pthread_mutex_lock(&valuesLock);
+    currentTick++;
+
+    if (currentTick % WHEEL_SLOTS == 0)
+    {
+        int slot = WHEEL_SLOTS + (currentTick / WHEEL_SLOTS) % WHEEL_SLOTS;
+        int key = wheel[slot];
+        wheel[slot] = -1;
+        while (key >= 0)
         {
-            int sPort;
-            char sAddress[INET_ADDRSTRLEN];
-            sscanf(inputBuffer, "%*s %d %s", &sPort, sAddress);
-            successorPort = sPort;
-            strcpy(successorAddress, sAddress);
-            successorFD = create_connection(successorAddress, successorPort);
+            int next = timerNext[key];
+            timerSlot[key] = -1;
+            scheduleExpiry(key);
+            key = next;
         }
-        else if (strcmp("updateRange0", command) == 0)
+    }
+
+    int slot = currentTick % WHEEL_SLOTS;
+    int key = wheel[slot];
+    while (key >= 0)
+    {
+        int next = timerNext[key];
+        if (expiresAt[key] <= currentTick)
         {
-            sscanf(inputBuffer, "%*s %d", &range[0]);
-            readAmount = read(predecessorFD, inputBuffer, BUFFER_SIZE);
-            while (strcmp("EOF", inputBuffer) != 0)
-            {
-                int key;
-                char value[BUFFER_SIZE];
-                sscanf(inputBuffer, "%d %s ", &key, value);
-                insert(key, value);
-                readAmount = read(predecessorFD, inputBuffer, BUFFER_SIZE);
-            }
+            removeValue(key);
+            expiredCount++;
         }
-        else if (strcmp("lookupNext", command) == 0)
+        key = next;
+    }
+    pthread_mutex_unlock(&valuesLock);
+}
+
+// Background thread that drives the timing wheel once a second.
+void *expiryMain(void *arg)
+{
+    while (1)
+    {
+        sleep(1);
+        expiryTick();
+    }
+    return NULL;
+}
+
+// Prints the memory accounting and eviction counters for this node.
+void printStats()
+{
+    printf("Memory used: %zu / %zu bytes\n", memoryUsed, memoryBudget);
+    printf("Evictions: %lu\n", evictionCount);
+    printf("Memory pressure events: %lu\n", pressureCount);
+    printf("Rejected inserts: %lu\n", rejectedCount);
+    printf("Expired keys: %lu\n", expiredCount);
+    printf("Sync keys sent: %lu\n", syncKeysSent);
+    printf("Sync subtrees skipped: %lu\n", syncSubtreesSkipped);
+    printf("Writes forwarded during migration: %lu\n", migratedWrites);
+    printf("Load: %lu\n", nodeLoad());
+    printf("Range shifts: %lu\n", rangeShifts);
+    printf("Failovers: %lu\n", failoverCount);
+    printf("Successor list:");
+    for (int i = 0; i < successorListCount; i++)
+    {
+        printf(" %d@%s:%d", successorList[i].id, successorList[i].address, successorList[i].port);
+    }
+    printf("\n");
+    printf("Hedge delay: %llu us (p%d)\n", hedgeDelay, hedgePercentile);
+    printf("Hedges sent: %lu\n", hedgesSent);
+    printf("Duplicate replies dropped: %lu\n", duplicateReplies);
+    printf("Expired requests dropped: %lu\n", expiredDropped);
+    printf("Requests timed out: %lu\n", timedOutRequests);
+}
+
+// Prints the result of a client command. Tag is the input line of a batch command, 0 for one typed in.
+// Tagged results are printed with their line number and free up a slot for the batch.
+void printResult(int tag, char *result)
+{
+    if (tag == 0)
+    {
+        printf("%s", result);
+        return;
+    }
+    printf("[%d] %s", tag, result);
+    pthread_mutex_lock(&batchLock);
+    if (inFlight > 0)
+    {
+        inFlight--;
+    }
+    pthread_cond_signal(&batchCond);
+    pthread_mutex_unlock(&batchLock);
+}
+
+// Monotonic time in microseconds, used for request latencies and deadlines.
+unsigned long long nowMicros()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (unsigned long long)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+// Requests carry the microseconds they have left rather than a point in time, so nodes never compare clocks.
+// Each node takes off the time the request spent with it before passing it on.
+// Returns what is left of budget for a request that arrived at receivedAt, -1 once it has run out.
+// A budget of 0 means no deadline and stays 0.
+long long remainingBudget(unsigned long long budget, unsigned long long receivedAt)
+{
+    if (budget == 0)
+    {
+        return 0;
+    }
+    long long left = (long long)budget - (long long)(nowMicros() - receivedAt);
+    return left > 0 ? left : -1;
+}
+
+// Starts tracking a request for key that is about to be sent around the ring.
+// Returns its id and sets *budget to the microseconds it has to get answered.
+unsigned long addPending(int tag, int key, unsigned long long *budget)
+{
+    *budget = deadlineMillis * 1000ULL;
+    pthread_mutex_lock(&pendingLock);
+    unsigned long id = nextRequestID++;
+    pendingRequestStruct *request = &pending[id % MAX_PENDING];
+    if (request->id == 0)
+    {
+        pendingCount++;
+    }
+    request->id = id;
+    request->tag = tag;
+    request->key = key;
+    request->hedged = 0;
+    request->sentAt = nowMicros();
+    request->deadline = request->sentAt + *budget;
+    request->message[0] = '\0';
+    pthread_cond_signal(&pendingCond);
+    pthread_mutex_unlock(&pendingLock);
+    return id;
+}
+
+// Stops tracking request id, for requests that never got sent.
+void cancelPending(unsigned long id)
+{
+    pthread_mutex_lock(&pendingLock);
+    if (pending[id % MAX_PENDING].id == id)
+    {
+        pending[id % MAX_PENDING].id = 0;
+        pendingCount--;
+    }
+    pthread_mutex_unlock(&pendingLock);
+}
+
+// Keeps the message for request id so it can be hedged if it is slow.
+void armHedge(unsigned long id, char *message)
+{
+    pthread_mutex_lock(&pendingLock);
+    if (pending[id % MAX_PENDING].id == id)
+    {
+        strcpy(pending[id % MAX_PENDING].message, message);
+        pthread_cond_signal(&pendingCond);
+    }
+    pthread_mutex_unlock(&pendingLock);
+}
+
+// Sets hedgeDelay to the hedge percentile of the recent latencies.
+void updateHedgeDelay()
+{
+    unsigned long long sorted[LATENCY_SAMPLES];
+    pthread_mutex_lock(&pendingLock);
+    int count = latencyCount;
+    memcpy(sorted, latencies, count * sizeof(unsigned long long));
+    pthread_mutex_unlock(&pendingLock);
+    if (count < LATENCY_MIN_SAMPLES)
+    {
+        return;
+    }
+
+    // Insertion sort, there are only LATENCY_SAMPLES of them
+    for (int i = 1; i < count; i++)
+    {
+        unsigned long long latency = sorted[i];
+        int j = i - 1;
+        while (j >= 0 && sorted[j] > latency)
+        {
+            sorted[j + 1] = sorted[j];
+            j--;
+        }
+        sorted[j + 1] = latency;
+    }
+    hedgeDelay = sorted[(count - 1) * hedgePercentile / 100];
+}
+
+// Prints the result for request id if it is still waiting on one and records how long it took.
+// The first reply wins, later ones and replies to requests that already timed out are dropped.
+void completePending(unsigned long id, char *result)
+{
+    pthread_mutex_lock(&pendingLock);
+    pendingRequestStruct *request = &pending[id % MAX_PENDING];
+    if (id == 0 || request->id != id)
+    {
+        duplicateReplies++;
+        pthread_mutex_unlock(&pendingLock);
+        return;
+    }
+    latencies[latencyNext] = nowMicros() - request->sentAt;
+    latencyNext = (latencyNext + 1) % LATENCY_SAMPLES;
+    if (latencyCount < LATENCY_SAMPLES)
+    {
+        latencyCount++;
+    }
+    int tag = request->tag;
+    request->id = 0;
+    pendingCount--;
+    int update = ++latenciesSinceUpdate % HEDGE_UPDATE_INTERVAL == 0;
+    pthread_mutex_unlock(&pendingLock);
+    printResult(tag, result);
+    if (update)
+    {
+        updateHedgeDelay();
+    }
+}
+
+// 1 if key is in (lo, hi] going clockwise around the ring.
+int between(int key, int lo, int hi)
+{
+    if (lo < hi)
+    {
+        return lo < key && key <= hi;
+    }
+    return key > lo || key <= hi;
+}
+
+// Sends a second copy of a slow lookup by another route than successorFD. It goes straight to whichever
+// node in our successor list should own key, skipping the hops in between, or as far along the list as we know.
+// If that is our successor the copy still goes on a connection of its own, so it gets its own handler there.
+void sendHedge(int key, char *message)
+{
+    pthread_mutex_lock(&heartbeatLock);
+    nodeAddressStruct target;
+    strcpy(target.address, successorAddress);
+    target.port = successorPort;
+    int lo = range[1];
+    for (int i = 0; i < successorListCount; i++)
+    {
+        target = successorList[i];
+        if (between(key, lo, successorList[i].id))
+        {
+            break;
+        }
+        lo = successorList[i].id;
+    }
+    pthread_mutex_unlock(&heartbeatLock);
+
+    if (hedgeFD < 0 || hedgePort != target.port || strcmp(hedgeAddress, target.address) != 0)
+    {
+        if (hedgeFD >= 0)
+        {
+            close(hedgeFD);
+        }
+        strcpy(hedgeAddress, target.address);
+        hedgePort = target.port;
+        hedgeFD = create_connection(hedgeAddress, hedgePort);
+    }
+    if (hedgeFD >= 0 && sendMessage(hedgeFD, message, strlen(message)) >= 0)
+    {
+        hedgesSent++;
+    }
+}
+
+// Background thread watching our pending requests. It sleeps until the earliest time a lookup
+// should be hedged or a request runs out of time, and not at all while nothing is pending.
+// Lookups that have waited longer than the hedge delay get their hedged copy, and requests past their deadline are given up on.
+void *hedgeMain(void *arg)
+{
+    pthread_mutex_lock(&pendingLock);
+    while (1)
+    {
+        while (pendingCount == 0)
+        {
+            pthread_cond_wait(&pendingCond, &pendingLock);
+        }
+
+        unsigned long long now = nowMicros();
+        unsigned long long next = 0;
+        int acted = 0;
+        for (int i = 0; i < MAX_PENDING; i++)
+        {
+            pendingRequestStruct *request = &pending[i];
+            if (request->id == 0)
+            {
+                continue;
+            }
+            if (now > request->deadline)
+            {
+                int tag = request->tag;
+                request->id = 0;
+                pendingCount--;
+                timedOutRequests++;
+                pthread_mutex_unlock(&pendingLock);
+                printResult(tag, "Request timed out\n");
+                pthread_mutex_lock(&pendingLock);
+                acted = 1;
+                continue;
+            }
+            if (next == 0 || request->deadline < next)
+            {
+                next = request->deadline;
+            }
+            if (hedgePercentile == 0 || request->hedged || request->message[0] == '\0')
+            {
+                continue;
+            }
+            if (now - request->sentAt < hedgeDelay)
+            {
+                if (request->sentAt + hedgeDelay < next)
+                {
+                    next = request->sentAt + hedgeDelay;
+                }
+                continue;
+            }
+            request->hedged = 1;
+            int key = request->key;
+            char message[BUFFER_SIZE];
+            strcpy(message, request->message);
+            // The budget is the last field, the copy only gets what is left of it
+            snprintf(strrchr(message, ' '), BUFFER_SIZE - (strrchr(message, ' ') - message), " %llu", request->deadline - now);
+            pthread_mutex_unlock(&pendingLock);
+            sendHedge(key, message);
+            pthread_mutex_lock(&pendingLock);
+            acted = 1;
+        }
+
+        // Requests added while the lock was let go may not have been seen, so look again straight away
+        if (acted || next == 0)
+        {
+            continue;
+        }
+        unsigned long long wait = next - now + 1;
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += wait / 1000000;
+        deadline.tv_nsec += (wait % 1000000) * 1000;
+        deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+        deadline.tv_nsec %= 1000000000L;
+        pthread_cond_timedwait(&pendingCond, &pendingLock, &deadline);
+    }
+    pthread_mutex_unlock(&pendingLock);
+    return NULL;
+}
+
+// 1 if the other end of fd has closed it. Only meaningful on connections the other side never writes to.
+int connectionClosed(int fd)
+{
+    char c;
+    return recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT) == 0;
+}
+
+// Sends message on to our successor. If the successor is gone we have the heartbeat thread
+// fail over straight away and send through whichever node replaces it.
+// A write to a dead peer can still succeed once, so a closed connection is checked for first.
+void forwardMessage(char *message)
+{
+    int oldFD = successorFD;
+    if (strlen(message) > BUFFER_SIZE - 1)
+    {
+        // Not the successor's fault, sendMessage reports it
+        sendMessage(successorFD, message, strlen(message));
+        return;
+    }
+    if (!connectionClosed(successorFD) && sendMessage(successorFD, message, strlen(message)) >= 0)
+    {
+        return;
+    }
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += (HEARTBEAT_INTERVAL_MS * MISSED_HEARTBEATS) / 1000 + 1;
+    pthread_mutex_lock(&heartbeatLock);
+    successorSuspect = 1;
+    pthread_cond_signal(&heartbeatCond);
+    while (successorFD == oldFD && pthread_cond_timedwait(&failoverCond, &heartbeatLock, &deadline) == 0)
+    {
+    }
+    pthread_mutex_unlock(&heartbeatLock);
+    sendMessage(successorFD, message, strlen(message));
+}
+
+// Sends the result of a client command back to the node at address:port that it came from.
+// Connections are opened on first use and reused after that.
+void sendResult(char *address, int port, char *message)
+{
+    pthread_mutex_lock(&resultLock);
+    int fd = -1;
+    for (int i = 0; i < resultConnectionCount; i++)
+    {
+        if (resultConnections[i].port == port && strcmp(resultConnections[i].address, address) == 0)
+        {
+            fd = resultConnections[i].fd;
+        }
+    }
+    if (fd >= 0)
+    {
+        if (sendMessage(fd, message, strlen(message)) < 0)
+        {
+            // The origin restarted since we last answered it, reconnect
+            close(fd);
+            fd = create_connection(address, port);
+            for (int i = 0; i < resultConnectionCount; i++)
+            {
+                if (resultConnections[i].port == port && strcmp(resultConnections[i].address, address) == 0)
+                {
+                    resultConnections[i].fd = fd;
+                }
+            }
+            sendMessage(fd, message, strlen(message));
+        }
+    }
+    else if (resultConnectionCount < MAX_RESULT_CONNECTIONS)
+    {
+        fd = create_connection(address, port);
+        if (fd < 0)
+        {
+            // The origin is gone, nobody to answer
+            pthread_mutex_unlock(&resultLock);
+            return;
+        }
+        strcpy(resultConnections[resultConnectionCount].address, address);
+        resultConnections[resultConnectionCount].port = port;
+        resultConnections[resultConnectionCount].fd = fd;
+        resultConnectionCount++;
+        sendMessage(fd, message, strlen(message));
+    }
+    else
+    {
+        // Table is full, use a connection just for this result
+        fd = create_connection(address, port);
+        sendMessage(fd, message, strlen(message));
+        close(fd);
+    }
+    pthread_mutex_unlock(&resultLock);
+}
+
+// Tells the origin of request id that it grew too long to pass on, the traversed list gets longer every hop.
+void rejectTooLong(char *originAddress, int originPort, unsigned long id)
+{
+    char message[BUFFER_SIZE];
+    snprintf(message, sizeof(message), "PRINT %lu Request too long to forward\n", id);
+    sendResult(originAddress, originPort, message);
+}
+
+// Parses the length characters at text as a TTL in seconds into *ttl.
+// Returns 1 if they are all digits and no more than MAX_TTL, 0 otherwise.
+int parseTTL(char *text, size_t length, unsigned long *ttl)
+{
+    if (length == 0 || length > 20)
+    {
+        return 0;
+    }
+    for (size_t i = 0; i < length; i++)
+    {
+        if (text[i] < '0' || text[i] > '9')
+        {
+            return 0;
+        }
+    }
+    char *end;
+    errno = 0;
+    unsigned long parsed = strtoul(text, &end, 10);
+    if (errno != 0 || end != text + length || parsed > MAX_TTL)
+    {
+        return 0;
+    }
+    *ttl = parsed;
+    return 1;
+}
+
+// Parses the next "key value [ttl]" line between *cursor and end, the format used for config files, dumps and imports.
+// Advances *cursor past the line. Returns 1 if a record was read, 0 at the end of the data.
+// Lines that do not hold a valid record are skipped.
+int parseRecord(char **cursor, char *end, int *key, char *value, unsigned long *ttl)
+{
+    while (*cursor < end)
+    {
+        char *line = *cursor;
+        char *lineEnd = memchr(line, '\n', end - line);
+        if (lineEnd == NULL)
+        {
+            lineEnd = end;
+        }
+        *cursor = lineEnd < end ? lineEnd + 1 : end;
+
+        // Split the line into at most three whitespace separated fields
+        char *fields[3];
+        int lengths[3];
+        int count = 0;
+        char *c = line;
+        while (c < lineEnd && count < 3)
+        {
+            while (c < lineEnd && (*c == ' ' || *c == '\t' || *c == '\r'))
+            {
+                c++;
+            }
+            if (c == lineEnd)
+            {
+                break;
+            }
+            fields[count] = c;
+            while (c < lineEnd && *c != ' ' && *c != '\t' && *c != '\r')
+            {
+                c++;
+            }
+            lengths[count] = c - fields[count];
+            count++;
+        }
+        if (count < 2 || lengths[1] >= BUFFER_SIZE)
+        {
+            continue;
+        }
+
+        char *keyEnd;
+        *key = (int)strtol(fields[0], &keyEnd, 10);
+        if (keyEnd != fields[0] + lengths[0] || *key < 0 || *key >= HASH_SPACE)
+        {
+            continue;
+        }
+        *ttl = 0;
+        if (count == 3 && !parseTTL(fields[2], lengths[2], ttl))
+        {
+            continue;
+        }
+        memcpy(value, fields[1], lengths[1]);
+        value[lengths[1]] = '\0';
+        return 1;
+    }
+    return 0;
+}
+
+// Formats key as a "key value [ttl]" record line into buffer. Returns the length, 0 if there is no live value
+// or the record doesn't fit in size bytes.
+int formatRecord(int key, char *buffer, size_t size)
+{
+    int length = 0;
+    if (!hasValue(key))
+    {
+        return 0;
+    }
+    pthread_mutex_lock(&valuesLock);
+    if (values[key] != NULL)
+    {
+        unsigned long ttl = remainingTTL(key);
+        if (ttl > 0)
+        {
+            length = snprintf(buffer, size, "%d %s %lu\n", key, values[key], ttl);
+        }
+        else
+        {
+            length = snprintf(buffer, size, "%d %s\n", key, values[key]);
+        }
+    }
+    pthread_mutex_unlock(&valuesLock);
+    return length < (int)size ? length : 0;
+}
+
+// Sends the key at i with its expiry stamp and waits for the ack.
+// Returns 0 once acked, -1 if the receiver went away or stopped answering.
+int sendKey(int fd, int i)
+{
+    char message[BUFFER_SIZE];
+    pthread_mutex_lock(&valuesLock);
+    if (values[i] == NULL)
+    {
+        snprintf(message, sizeof(message), "drop %d %d", i, i);
+    }
+    else
+    {
+        snprintf(message, sizeof(message), "%d %s %lld", i, values[i], (long long)expiryStamp[i]);
+    }
+    pthread_mutex_unlock(&valuesLock);
+    if (sendMessage(fd, message, strlen(message)) < 0 || readMessage(fd, message) <= 0)
+    {
+        return -1;
+    }
+    syncKeysSent++;
+    if (strcmp(message, "ack") != 0)
+    {
+        printf("an error occured\n");
+    }
+    return 0;
+}
+
+// Brings the receiver's copy of the keys under Merkle node in line with ours.
+// Matching subtrees are skipped, subtrees the receiver has nothing under are streamed whole,
+// and subtrees we have nothing under are dropped on the receiver in one message.
+// Returns 0 when done, -1 as soon as the receiver goes away or stops answering.
+int syncNode(int fd, int node)
+{
+    // Work out the keys [first, last] under node
+    int size = 1;
+    int leaf = node;
+    while (leaf < HASH_SPACE)
+    {
+        leaf *= 2;
+        size *= 2;
+    }
+    int first = leaf - HASH_SPACE;
+    int last = first + size - 1;
+
+    char message[BUFFER_SIZE];
+    if (merkle[node] == 0)
+    {
+        snprintf(message, sizeof(message), "drop %d %d", first, last);
+        if (sendMessage(fd, message, strlen(message)) < 0 || readMessage(fd, message) <= 0)
+        {
+            return -1;
+        }
+        return 0;
+    }
+
+    snprintf(message, sizeof(message), "sync %d %llu", node, merkle[node]);
+    if (sendMessage(fd, message, strlen(message)) < 0 || readMessage(fd, message) <= 0)
+    {
+        return -1;
+    }
+    if (strcmp(message, "same") == 0)
+    {
+        syncSubtreesSkipped++;
+    }
+    else if (strcmp(message, "empty") == 0 || node >= HASH_SPACE)
+    {
+        for (int i = first; i <= last; i++)
+        {
+            if (values[i] != NULL && sendKey(fd, i) < 0)
+            {
+                return -1;
+            }
+        }
+    }
+    else if (syncNode(fd, 2 * node) < 0 || syncNode(fd, 2 * node + 1) < 0)
+    {
+        return -1;
+    }
+    return 0;
+}
+
+// Syncs the keys in [lo, hi], which must not wrap, with the receiver. Returns -1 if the receiver went away.
+// The range is covered by the largest aligned Merkle subtrees that fit in it, and each is synced
+// top down so that only keys that differ from the receiver's copy are sent. Expired keys are skipped.
+int syncSegment(int fd, int lo, int hi)
+{
+    for (int i = lo; i <= hi; i++)
+    {
+        hasValue(i);
+    }
+
+    int key = lo;
+    while (key <= hi)
+    {
+        int size = 1;
+        while (size < HASH_SPACE && key % (size * 2) == 0 && key + size * 2 - 1 <= hi)
+        {
+            size *= 2;
+        }
+        if (syncNode(fd, (HASH_SPACE + key) / size) < 0)
+        {
+            return -1;
+        }
+        key += size;
+    }
+    return 0;
+}
+
+// Hands the keys in [lo, hi] to the node on the other end of fd, which must be running receiveRange.
+// lo > hi is a range that wraps past the end of the hash space, like the bootstrap's or one taken over on failover.
+// Returns 0 once the receiver has acked all of it, -1 if it went away.
+int sendRange(int fd, int lo, int hi)
+{
+    char message[BUFFER_SIZE];
+
+    // Wait for the receiver to be ready
+    if (readMessage(fd, message) <= 0)
+    {
+        return -1;
+    }
+
+    int failed;
+    if (lo > hi)
+    {
+        // Sent as its two halves either side of the wrap
+        failed = syncSegment(fd, lo, HASH_SPACE - 1) < 0 || syncSegment(fd, 0, hi) < 0;
+    }
+    else
+    {
+        failed = syncSegment(fd, lo, hi) < 0;
+    }
+    if (failed)
+    {
+        return -1;
+    }
+
+    if (sendMessage(fd, "EOF", strlen("EOF")) < 0 || readMessage(fd, message) <= 0)
+    {
+        return -1;
+    }
+    return strcmp(message, "ack") == 0 ? 0 : -1;
+}
+
+// Starts forwarding writes to keys in [lo, hi] to the node at address:port, which is taking the range over.
+// The range may wrap past the end of the hash space.
+void beginMigration(int lo, int hi, char *address, int port)
+{
+    pthread_mutex_lock(&migrateLock);
+    migrateFD = create_connection(address, port);
+    // Forwarded writes wait on the ack with ownershipLock held, a stalled receiver mustn't hold them forever
+    struct timeval timeout = {HANDOVER_TIMEOUT, 0};
+    setsockopt(migrateFD, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    migrateHi = hi;
+    migrateLo = lo;
+    pthread_mutex_unlock(&migrateLock);
+}
+
+// Stops forwarding writes once the new owner has taken the range over.
+void endMigration()
+{
+    pthread_mutex_lock(&migrateLock);
+    migrateLo = -1;
+    migrateHi = -1;
+    close(migrateFD);
+    migrateFD = -1;
+    pthread_mutex_unlock(&migrateLock);
+}
+
+// Forwards our current value for key to the new owner if key is in a range being migrated.
+// Called after every write to a key we own, with ownershipLock held shared.
+void migrateWrite(int key)
+{
+    pthread_mutex_lock(&migrateLock);
+    if (migrateLo < 0 || !between(key, (migrateLo + HASH_SPACE - 1) % HASH_SPACE, migrateHi))
+    {
+        pthread_mutex_unlock(&migrateLock);
+        return;
+    }
+    char message[BUFFER_SIZE];
+    pthread_mutex_lock(&valuesLock);
+    if (values[key] == NULL)
+    {
+        snprintf(message, sizeof(message), "replicate %d", key);
+    }
+    else
+    {
+        snprintf(message, sizeof(message), "replicate %d %s %lld", key, values[key], (long long)expiryStamp[key]);
+    }
+    pthread_mutex_unlock(&valuesLock);
+    sendMessage(migrateFD, message, strlen(message));
+    readMessage(migrateFD, message);
+    migratedWrites++;
+    pthread_mutex_unlock(&migrateLock);
+}
+
+// Receives a range sent by sendRange on fd. Answers its Merkle comparisons against this
+// node's tree and applies the keys and drops it sends, until EOF.
+void receiveRange(int fd)
+{
+    char inputBuffer[BUFFER_SIZE];
+    sendMessage(fd, "ack", strlen("ack"));
+    while (readMessage(fd, inputBuffer) > 0)
+    {
+        char command[BUFFER_SIZE];
+        sscanf(inputBuffer, "%s", command);
+        if (strcmp("EOF", command) == 0)
+        {
+            sendMessage(fd, "ack", strlen("ack"));
+            return;
+        }
+        else if (strcmp("sync", command) == 0)
+        {
+            int node;
+            unsigned long long hash;
+            sscanf(inputBuffer, "%*s %d %llu", &node, &hash);
+            if (merkle[node] == 0)
+            {
+                sendMessage(fd, "empty", strlen("empty"));
+            }
+            else if (merkle[node] == hash)
+            {
+                sendMessage(fd, "same", strlen("same"));
+            }
+            else
+            {
+                sendMessage(fd, "diff", strlen("diff"));
+            }
+        }
+        else if (strcmp("drop", command) == 0)
+        {
+            int first, last;
+            sscanf(inputBuffer, "%*s %d %d", &first, &last);
+            for (int i = first; i <= last; i++)
+            {
+                delete (i, NULL);
+            }
+            sendMessage(fd, "ack", strlen("ack"));
+        }
+        else
+        {
+            int key;
+            char value[BUFFER_SIZE];
+            long long stamp = 0;
+            sscanf(inputBuffer, "%d %s %lld", &key, value, &stamp);
+            insertStamped(key, value, (time_t)stamp);
+            sendMessage(fd, "ack", strlen("ack"));
+        }
+    }
+}
+
+// Lets the new node id at address:port2 into the ring if id falls in our range, otherwise passes it on to our successor.
+// The owner hands the new node [range[0], id] and becomes its successor. Only the owner's range is locked while
+// this happens, so joins landing in different ranges go ahead at the same time.
+void joinNode(int id, int port2, char *address, char *traversedList)
+{
+    pthread_mutex_lock(&rangeLock);
+    if (inRange(id) && id == range[1])
+    {
+        // The id is taken by us, nobody further round would ever accept it
+        pthread_mutex_unlock(&rangeLock);
+        int fd = create_connection(address, port2);
+        if (fd >= 0)
+        {
+            char message[BUFFER_SIZE];
+            snprintf(message, sizeof(message), "enterFailed %d %s", id, traversedList);
+            sendMessage(fd, message, strlen(message));
+            close(fd);
+        }
+        return;
+    }
+    if (!inRange(id))
+    {
+        pthread_mutex_unlock(&rangeLock);
+
+        // pass this message along to the successor
+        char message[BUFFER_SIZE];
+        snprintf(message, sizeof(message), "%s %d %d %s %s", "entering", id, port2, address, traversedList);
+        forwardMessage(message);
+        return;
+    }
+    printf("Id %d in range %d %d\n", id, range[0], range[1]);
+
+    // send predecessor, ourselves as successor, range info and traversed list
+    char message[BUFFER_SIZE];
+    snprintf(message, sizeof(message), "entered %d %s %d %s %d %s", predecessorPort, predecessorAddress, port, myIP, range[0], traversedList);
+
+    // pass along all key values in the new node's range
+    // We keep serving the range while it is copied, forwarding writes to the new node as they happen.
+    // Our copy is kept so a later handoff back only has to send what changed.
+    int lo = range[0];
+    int newFD = create_connection(address, port2);
+    if (newFD < 0)
+    {
+        pthread_mutex_unlock(&rangeLock);
+        printf("Join of %d failed, can't reach it\n", id);
+        return;
+    }
+    // We hold rangeLock, and ownershipLock for the flip, while waiting on the new node.
+    // One that stalls is given up on rather than freezing our writes and failover.
+    struct timeval timeout = {HANDOVER_TIMEOUT, 0};
+    setsockopt(newFD, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    beginMigration(lo, id, address, port2);
+    sendMessage(newFD, message, strlen(message));
+    if (sendRange(newFD, lo, id) < 0)
+    {
+        endMigration();
+        close(newFD);
+        pthread_mutex_unlock(&rangeLock);
+        printf("Join of %d failed, keeping [%d, %d]\n", id, range[0], range[1]);
+        return;
+    }
+
+    // Writes to the current predecessor to update its successor to the NEW NODE
+    // Until the new node owns its range it passes everything it gets on to us.
+    char m2[BUFFER_SIZE];
+    snprintf(m2, sizeof(m2), "%s %d %s", "updateSuccessor", port2, address);
+    sendMessage(predecessorFD, m2, strlen(m2));
+    readMessage(predecessorFD, m2);
+
+    // Flip ownership. Writes to our range are held while anything the forwarding missed is synced.
+    // The range only changes hands once the new node acks that it has all of it.
+    pthread_rwlock_wrlock(&ownershipLock);
+    snprintf(message, sizeof(message), "updateRange0 %d", lo);
+    if (sendMessage(newFD, message, strlen(message)) < 0 || sendRange(newFD, lo, id) < 0 ||
+        readMessage(newFD, message) <= 0 || strcmp(message, "ack") != 0)
+    {
+        // Keep serving the range ourselves and point our predecessor back at us
+        endMigration();
+        pthread_rwlock_unlock(&ownershipLock);
+        close(newFD);
+        snprintf(m2, sizeof(m2), "%s %d %s", "updateSuccessor", port, myIP);
+        sendMessage(predecessorFD, m2, strlen(m2));
+        readMessage(predecessorFD, m2);
+        pthread_mutex_unlock(&rangeLock);
+        printf("Join of %d failed, keeping [%d, %d]\n", id, range[0], range[1]);
+        return;
+    }
+    range[0] = id + 1;
+    endMigration();
+    pthread_rwlock_unlock(&ownershipLock);
+
+    close(predecessorFD);
+    predecessorPort = port2;
+    strcpy(predecessorAddress, address);
+    predecessorFD = newFD;
+    pthread_mutex_unlock(&rangeLock);
+    printf("Range: [%d, %d]\n", range[0], range[1]);
+}
+
+// Compares our load with our successor's and, if we are much hotter, moves our id down so the successor
+// takes over the top of our range. The range is migrated the same way as on enter and exit.
+void rebalance()
+{
+    // The bootstrap's id always stays 0
+    if (!inRing || range[1] == 0 || range[0] > range[1])
+    {
+        return;
+    }
+    pthread_mutex_lock(&rangeLock);
+    unsigned long myLoad = nodeLoad();
+    if (myLoad < MIN_HOT_LOAD)
+    {
+        pthread_mutex_unlock(&rangeLock);
+        return;
+    }
+
+    // A connection of our own, successorFD carries forwarded requests
+    char message[BUFFER_SIZE];
+    int fd = create_connection(successorAddress, successorPort);
+    if (fd < 0)
+    {
+        pthread_mutex_unlock(&rangeLock);
+        return;
+    }
+    sendMessage(fd, "getLoad", strlen("getLoad"));
+    readMessage(fd, message);
+    unsigned long successorLoad = strtoul(message, NULL, 10);
+
+    if (myLoad <= HOT_FACTOR * successorLoad)
+    {
+        close(fd);
+        pthread_mutex_unlock(&rangeLock);
+        return;
+    }
+
+    // Walk down from our id until about half the difference in load would move
+    unsigned long target = (myLoad - successorLoad) / 2;
+    unsigned long moved = 0;
+    int boundary = range[1];
+    while (boundary > range[0] + 1 && moved + hits[boundary] <= target)
+    {
+        moved += hits[boundary];
+        boundary--;
+    }
+    if (boundary == range[1])
+    {
+        // A single key carries the load, moving it would just make the successor hot instead
+        close(fd);
+        pthread_mutex_unlock(&rangeLock);
+        return;
+    }
+    boundary++;
+    int oldID = range[1];
+
+    beginMigration(boundary, oldID, successorAddress, successorPort);
+    sendMessage(fd, "syncRange", strlen("syncRange"));
+    if (sendRange(fd, boundary, oldID) < 0)
+    {
+        endMigration();
+        close(fd);
+        pthread_mutex_unlock(&rangeLock);
+        printf("Rebalance failed, successor went away\n");
+        return;
+    }
+
+    // Second pass with writes held only has to carry anything the forwarding missed
+    // Our id only moves once the successor acks that it has all of the range.
+    pthread_rwlock_wrlock(&ownershipLock);
+    snprintf(message, sizeof(message), "updateRange0 %d", boundary);
+    if (sendMessage(fd, message, strlen(message)) < 0 || sendRange(fd, boundary, oldID) < 0 ||
+        readMessage(fd, message) <= 0 || strcmp(message, "ack") != 0)
+    {
+        endMigration();
+        pthread_rwlock_unlock(&ownershipLock);
+        close(fd);
+        pthread_mutex_unlock(&rangeLock);
+        printf("Rebalance failed, successor didn't take over [%d, %d]\n", boundary, oldID);
+        return;
+    }
+    range[1] = boundary - 1;
+    endMigration();
+    pthread_rwlock_unlock(&ownershipLock);
+
+    close(fd);
+    pthread_mutex_unlock(&rangeLock);
+    rangeShifts++;
+    printf("Rebalanced: handed [%d, %d] to successor\n", boundary, oldID);
+    printf("Range: [%d, %d]\n", range[0], range[1]);
+}
+
+// Background thread that decays the hit counters and rebalances every REBALANCE_INTERVAL seconds.
+void *rebalanceMain(void *arg)
+{
+    while (1)
+    {
+        sleep(REBALANCE_INTERVAL);
+        rebalance();
+        for (int i = 0; i < HASH_SPACE; i++)
+        {
+            hits[i] /= 2;
+        }
+    }
+    return NULL;
+}
+
+// create_connection for a node that may be down, retried a few times so one refused connect doesn't count as dead.
+int connectWithRetry(char *address, int port)
+{
+    for (int attempt = 0; attempt < CONNECT_ATTEMPTS; attempt++)
+    {
+        if (attempt > 0)
+        {
+            usleep(CONNECT_RETRY_MS * 1000);
+        }
+        int fd = create_connection(address, port);
+        if (fd >= 0)
+        {
+            return fd;
+        }
+    }
+    return -1;
+}
+
+// Replaces a successor that stopped answering heartbeats with the next live node in our successor list.
+// That node takes over the dead node's range by moving its range[0] down to just after our id.
+// If nobody after us is left we take the whole ring ourselves.
+void failover()
+{
+    pthread_mutex_lock(&rangeLock);
+    printf("Successor %s:%d is down\n", successorAddress, successorPort);
+    int lo = (range[1] + 1) % HASH_SPACE;
+
+    // Find the next live node after the suspect before touching anything
+    int fd = -1;
+    int next;
+    for (next = 1; next < successorListCount; next++)
+    {
+        if (successorList[next].port == port && strcmp(successorList[next].address, myIP) == 0)
+        {
+            break;
+        }
+        fd = connectWithRetry(successorList[next].address, successorList[next].port);
+        if (fd >= 0)
+        {
+            break;
+        }
+    }
+    if (fd < 0 && !successorListWraps)
+    {
+        // There may be live nodes past what we know of, so we can't take the range ourselves
+        pthread_mutex_unlock(&rangeLock);
+        printf("No live successor known yet, retrying\n");
+        return;
+    }
+
+    // Fence the suspect first. If it was only slow it drops out of the ring when it catches up
+    // instead of going on serving a range someone else now owns.
+    char message[BUFFER_SIZE];
+    int fenceFD = create_connection(successorAddress, successorPort);
+    if (fenceFD >= 0)
+    {
+        snprintf(message, sizeof(message), "fence %d %s", port, myIP);
+        sendMessage(fenceFD, message, strlen(message));
+        close(fenceFD);
+    }
+
+    // The new connection is made before the old one is closed, so forwards waiting on the old fd see it change
+    int oldFD = successorFD;
+    if (fd >= 0)
+    {
+        char reply[BUFFER_SIZE];
+        snprintf(message, sizeof(message), "failover %d %d %s", lo, port, myIP);
+        sendMessage(fd, message, strlen(message));
+        readMessage(fd, reply);
+        strcpy(successorAddress, successorList[next].address);
+        successorPort = successorList[next].port;
+        memmove(successorList, successorList + next, (successorListCount - next) * sizeof(nodeAddressStruct));
+        successorListCount -= next;
+        successorFD = fd;
+    }
+    else
+    {
+        // The list ran round to us, so everyone else is gone and the whole ring is ours
+        strcpy(successorAddress, myIP);
+        successorPort = port;
+        strcpy(predecessorAddress, myIP);
+        predecessorPort = port;
+        successorFD = create_connection(myIP, port);
+        close(predecessorFD);
+        predecessorFD = create_connection(myIP, port);
+        pthread_rwlock_wrlock(&ownershipLock);
+        range[0] = lo;
+        pthread_rwlock_unlock(&ownershipLock);
+        successorListCount = 0;
+    }
+    close(oldFD);
+    failoverCount++;
+
+    pthread_mutex_lock(&heartbeatLock);
+    pthread_cond_broadcast(&failoverCond);
+    pthread_mutex_unlock(&heartbeatLock);
+    pthread_mutex_unlock(&rangeLock);
+    printf("New successor: %s:%d\n", successorAddress, successorPort);
+    printf("Range: [%d, %d]\n", range[0], range[1]);
+}
+
+// Rebuilds our successor list from a heartbeat reply, which holds our successor followed by its own list.
+void updateSuccessorList(char *reply)
+{
+    nodeAddressStruct list[SUCCESSOR_LIST_SIZE];
+    int count = 0;
+    int wraps = 0;
+
+    int offset;
+    char *cursor = reply;
+    sscanf(cursor, "%*s%n", &offset);
+    cursor += offset;
+    while (count < SUCCESSOR_LIST_SIZE && sscanf(cursor, "%d %d %15s%n", &list[count].id, &list[count].port, list[count].address, &offset) == 3)
+    {
+        cursor += offset;
+        if (list[count].port == port && strcmp(list[count].address, myIP) == 0)
+        {
+            // The list has wrapped back around to us
+            wraps = 1;
+            break;
+        }
+        count++;
+    }
+
+    pthread_mutex_lock(&heartbeatLock);
+    memcpy(successorList, list, count * sizeof(nodeAddressStruct));
+    successorListCount = count;
+    successorListWraps = wraps;
+    pthread_mutex_unlock(&heartbeatLock);
+}
+
+// Background thread pinging our successor every HEARTBEAT_INTERVAL_MS over a connection of its own.
+// A closed connection means the successor died and we fail over at once. A successor that is
+// still connected but stops replying gets MISSED_HEARTBEATS intervals first.
+void *heartbeatMain(void *arg)
+{
+    char target[INET_ADDRSTRLEN] = "";
+    int targetPort = -1;
+    int fd = -1;
+    int missed = 0;
+    while (1)
+    {
+        // Wait out the interval unless a failed forward wakes us early
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += HEARTBEAT_INTERVAL_MS * 1000000L;
+        deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+        deadline.tv_nsec %= 1000000000L;
+        pthread_mutex_lock(&heartbeatLock);
+        while (!successorSuspect && pthread_cond_timedwait(&heartbeatCond, &heartbeatLock, &deadline) == 0)
+        {
+        }
+        successorSuspect = 0;
+        pthread_mutex_unlock(&heartbeatLock);
+
+        if (!inRing || (successorPort == port && strcmp(successorAddress, myIP) == 0))
+        {
+            // Nothing to watch
+            successorListCount = 0;
+            continue;
+        }
+        if (targetPort != successorPort || strcmp(target, successorAddress) != 0)
+        {
+            strcpy(target, successorAddress);
+            targetPort = successorPort;
+            missed = 0;
+            if (fd >= 0)
+            {
+                close(fd);
+                fd = -1;
+            }
+        }
+        if (fd < 0)
+        {
+            fd = connectWithRetry(target, targetPort);
+            struct timeval timeout = {0, HEARTBEAT_INTERVAL_MS * 1000};
+            setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        }
+
+        int dead = fd < 0;
+        if (!dead)
+        {
+            char inputBuffer[BUFFER_SIZE];
+            sendMessage(fd, "heartbeat", strlen("heartbeat"));
+            errno = 0;
+            if (readMessage(fd, inputBuffer) > 0)
+            {
+                missed = 0;
+                updateSuccessorList(inputBuffer);
+            }
+            else if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                // A late reply would be read as the next one, so start over on a new connection
+                missed++;
+                close(fd);
+                fd = -1;
+            }
+            else
+            {
+                dead = 1;
+            }
+        }
+
+        if (dead || missed >= MISSED_HEARTBEATS)
+        {
+            if (fd >= 0)
+            {
+                close(fd);
+                fd = -1;
+            }
+            missed = 0;
+            failover();
+        }
+    }
+    return NULL;
+}
+
+// handles all non bootstrap messages passed to nodes in the ring
+void *messageHandler(void *arg)
+{
+    // printf("Here in message handler\n");
+    clientDataStruct *newClientStruct = (clientDataStruct *)arg;
+
+    // clientFD is whichever node connected to us. Replies go back on it.
+    int clientFD = newClientStruct->fd;
+    free(newClientStruct);
+    char inputBuffer[BUFFER_SIZE];
+    while (1)
+    {
+        int readAmount = 0;
+        readAmount = readMessage(clientFD, inputBuffer);
+        // Request budgets count down from when they got here
+        unsigned long long receivedAt = nowMicros();
+        if (readAmount == 0)
+        {
+            close(clientFD);
+            pthread_exit(0);
+        }
+        char command[BUFFER_SIZE];
+        sscanf(inputBuffer, "%s", command);
+        // Results are printed on their own once they are matched up, heartbeats are just noise
+        if (strcmp("heartbeat", command) != 0 && strcmp("PRINT", command) != 0)
+        {
+            printf("%s\n", inputBuffer);
+        }
+        
+        if (strcmp("enter", command) == 0)
+        {
+            // Any node in the ring can receive this command from a new name server.
+            //  gets id, port, address
+            int id, port2;
+            char address[INET_ADDRSTRLEN];
+            sscanf(inputBuffer, "%*s %d %d %s", &id, &port2, address);
+            char traversedList[BUFFER_SIZE];
+            snprintf(traversedList, sizeof(traversedList), "%d", range[1]);
+            joinNode(id, port2, address, traversedList);
+        }
+        else if (strcmp("entering", command) == 0)
+        {
+            //  gets id, port, address
+            int id, port2;
+            char address[INET_ADDRSTRLEN];
+            char traversedList[BUFFER_SIZE];
+            sscanf(inputBuffer, "%*s %d %d %s %s", &id, &port2, address, traversedList);
+            snprintf(traversedList + strlen(traversedList), sizeof(traversedList) - strlen(traversedList), ",%d", range[1]);
+            joinNode(id, port2, address, traversedList);
+        } // entering
+        else if (strcmp("entered", command) == 0)
+        {
+            int sPort, pPort, rStart;
+            char sAddress[INET_ADDRSTRLEN], pAddress[INET_ADDRSTRLEN], traversedList[BUFFER_SIZE];
+            sscanf(inputBuffer, "%*s %d %s %d %s %d %s", &pPort, pAddress, &sPort, sAddress, &rStart, traversedList);
+            // update predecessor and successor info
+            successorPort = sPort;
+            strcpy(successorAddress, sAddress);
+            predecessorPort = pPort;
+            strcpy(predecessorAddress, pAddress);
+            int oldFD = successorFD;
+            successorFD = create_connection(successorAddress, successorPort);
+            if (oldFD > 0)
+            {
+                // Left open by our last exit
+                close(oldFD);
+            }
+            predecessorFD = create_connection(predecessorAddress, predecessorPort);
+            range[0] = rStart;
+
+            // sync all key values in our new range from SUCCESSOR, which sends them on this connection
+            // The successor keeps owning the range until it sends updateRange0, and until then
+            // we pass every request we get on to it.
+            receiveRange(clientFD);
+
+            // all prints
+            printf("successful entry\n");
+            printf("Range: [%d, %d]\n", range[0], range[1]);
+            sendMessage(successorFD, "getID", strlen("getID"));
+            readMessage(successorFD, inputBuffer);
+            int id;
+            sscanf(inputBuffer, "%d", &id);
+            sendMessage(predecessorFD, "getID", strlen("getID"));
+            readMessage(predecessorFD, inputBuffer);
+            int id2;
+            sscanf(inputBuffer, "%d", &id2);
+            printf("Predecessor ID: %d\n", id2);
+            printf("Sucessor ID: %d\n", id);
+            printf("Traversed: %s\n", traversedList);
+        } // entered
+        else if (strcmp("enterFailed", command) == 0)
+        {
+            int id;
+            char traversedList[BUFFER_SIZE];
+            sscanf(inputBuffer, "%*s %d %s", &id, traversedList);
+            printf("Id %d is already in the ring, pick another id\n", id);
+            printf("Traversed: %s\n", traversedList);
+        }
+        else if (strcmp("getID", command) == 0)
+        {
+            char message[BUFFER_SIZE];
+            snprintf(message, sizeof(message), "%d", range[1]);
+            sendMessage(clientFD, message, strlen(message));
+        }
+        else if (strcmp("updatePredecessor", command) == 0)
+        {
+            int pPort;
+            char pAddress[INET_ADDRSTRLEN];
+            sscanf(inputBuffer, "%*s %d %s", &pPort, pAddress);
+            predecessorPort = pPort;
+            strcpy(predecessorAddress, pAddress);
+            close(predecessorFD);
+            predecessorFD = create_connection(predecessorAddress, predecessorPort);
+        }
+        else if (strcmp("updateSuccessor", command) == 0)
+        {
+            int sPort;
+            char sAddress[INET_ADDRSTRLEN];
+            sscanf(inputBuffer, "%*s %d %s", &sPort, sAddress);
+            // Connect before closing the old link so forwards never write to a closed or reused fd
+            int newFD = create_connection(sAddress, sPort);
+            int oldFD = successorFD;
+            successorPort = sPort;
+            strcpy(successorAddress, sAddress);
+            successorFD = newFD;
+            close(oldFD);
+            sendMessage(clientFD, "ack", strlen("ack"));
+        }
+        else if (strcmp("replicate", command) == 0)
+        {
+            // A write to a range being migrated to us, forwarded by its current owner
+            int key;
+            char value[BUFFER_SIZE];
+            long long stamp = 0;
+            if (sscanf(inputBuffer, "%*s %d %s %lld", &key, value, &stamp) >= 2)
+            {
+                insertStamped(key, value, (time_t)stamp);
+            }
+            else
+            {
+                delete (key, NULL);
+            }
+            sendMessage(clientFD, "ack", strlen("ack"));
+        }
+        else if (strcmp("updateRange0", command) == 0)
+        {
+            // Our predecessor is handing us [newRange0, range[0] - 1]. We only take the range over once
+            // all of it has arrived, then ack so the sender knows it can stop serving it.
+            int newRange0;
+            sscanf(inputBuffer, "%*s %d", &newRange0);
+            receiveRange(clientFD);
+            range[0] = newRange0;
+            inRing = 1;
+            sendMessage(clientFD, "ack", strlen("ack"));
+        }
+        else if (strcmp("syncRange", command) == 0)
+        {
+            // Copy of a range our predecessor is about to hand us, it keeps owning it for now
+            receiveRange(clientFD);
+        }
+        else if (strcmp("heartbeat", command) == 0)
+        {
+            // Answer with ourselves and our successor list so our predecessor can skip past us and our successor
+            char message[BUFFER_SIZE];
+            int length = snprintf(message, sizeof(message), "alive %d %d %s", range[1], port, myIP);
+            pthread_mutex_lock(&heartbeatLock);
+            if (successorListCount > 0 && successorList[0].port == successorPort && strcmp(successorList[0].address, successorAddress) == 0)
+            {
+                for (int i = 0; i < successorListCount && i < SUCCESSOR_LIST_SIZE - 1; i++)
+                {
+                    length += snprintf(message + length, sizeof(message) - length, " %d %d %s", successorList[i].id, successorList[i].port, successorList[i].address);
+                }
+            }
+            pthread_mutex_unlock(&heartbeatLock);
+            sendMessage(clientFD, message, length);
+        }
+        else if (strcmp("fence", command) == 0)
+        {
+            // Our predecessor gave up on us and handed our range to our successor. Only trust it from our actual predecessor.
+            int pPort;
+            char pAddress[INET_ADDRSTRLEN];
+            sscanf(inputBuffer, "%*s %d %15s", &pPort, pAddress);
+            if (inRing && pPort == predecessorPort && strcmp(pAddress, predecessorAddress) == 0)
+            {
+                // From here on everything we get is passed on to our successor, the range's new owner
+                pthread_rwlock_wrlock(&ownershipLock);
+                inRing = 0;
+                pthread_rwlock_unlock(&ownershipLock);
+                printf("Fenced out of the ring by our predecessor, enter again to rejoin\n");
+            }
+        }
+        else if (strcmp("failover", command) == 0)
+        {
+            // Our predecessor died and the node before it is taking its place, we inherit its range
+            int lo, pPort;
+            char pAddress[INET_ADDRSTRLEN];
+            sscanf(inputBuffer, "%*s %d %d %15s", &lo, &pPort, pAddress);
+            pthread_mutex_lock(&rangeLock);
+            int oldLo = range[0];
+            pthread_rwlock_wrlock(&ownershipLock);
+            range[0] = lo;
+            pthread_rwlock_unlock(&ownershipLock);
+            predecessorPort = pPort;
+            strcpy(predecessorAddress, pAddress);
+            close(predecessorFD);
+            predecessorFD = create_connection(predecessorAddress, predecessorPort);
+            pthread_mutex_unlock(&rangeLock);
+            sendMessage(clientFD, "ack", strlen("ack"));
+            printf("Predecessor failed, took over [%d, %d]\n", lo, (oldLo + HASH_SPACE - 1) % HASH_SPACE);
+            printf("Range: [%d, %d]\n", range[0], range[1]);
+        }
+        else if (strcmp("getRange", command) == 0)
+        {
+            // Where we sit in the ring, used by dump and import to map out every node's range
+            char message[BUFFER_SIZE];
+            snprintf(message, sizeof(message), "%d %d %d %s", range[0], range[1], successorPort, successorAddress);
+            sendMessage(clientFD, message, strlen(message));
+        }
+        else if (strcmp("dumpRange", command) == 0)
+        {
+            // Streams every key we own back in batches of record lines, each acked
+            // A record has to fit in a batch on its own, keys with values too long for that are counted and skipped.
+            char message[BUFFER_SIZE];
+            int length = snprintf(message, sizeof(message), "batch\n");
+            int skipped = 0;
+            for (int i = 0; i < HASH_SPACE; i++)
+            {
+                if (!inRange(i) || !hasValue(i))
+                {
+                    continue;
+                }
+                char record[BUFFER_SIZE - sizeof("batch\n")];
+                int recordLength = formatRecord(i, record, sizeof(record));
+                if (recordLength == 0)
+                {
+                    skipped++;
+                    continue;
+                }
+                if (length + recordLength >= BUFFER_SIZE - 1)
+                {
+                    sendMessage(clientFD, message, length);
+                    readMessage(clientFD, inputBuffer);
+                    length = snprintf(message, sizeof(message), "batch\n");
+                }
+                memcpy(message + length, record, recordLength);
+                length += recordLength;
+            }
+            sendMessage(clientFD, message, length);
+            readMessage(clientFD, inputBuffer);
+            snprintf(message, sizeof(message), "EOF %d", skipped);
+            sendMessage(clientFD, message, strlen(message));
+        }
+        else if (strcmp("importBatch", command) == 0)
+        {
+            // A batch of record lines for keys we own. Anything that has moved since the
+            // importer mapped the ring is sent on to its owner the usual way.
+            char *cursor = strchr(inputBuffer, '\n');
+            char *end = inputBuffer + readAmount;
+            int key;
+            char value[BUFFER_SIZE];
+            unsigned long ttl;
+            int stored = 0;
+            int forwarded = 0;
+            int failed = 0;
+            while (cursor != NULL && parseRecord(&cursor, end, &key, value, &ttl))
+            {
+                pthread_rwlock_rdlock(&ownershipLock);
+                if (inRange(key))
+                {
+                    if (insert(key, value, ttl) < 0)
+                    {
+                        failed++;
+                    }
+                    else
+                    {
+                        stored++;
+                    }
+                    migrateWrite(key);
+                }
+                else
+                {
+                    char message[BUFFER_SIZE];
+                    if (snprintf(message, sizeof(message), "%s %d %s %d %lu %d %s %d %d", "inserting", key, value, range[1], ttl, port, myIP, 0, 0) >= (int)sizeof(message))
+                    {
+                        printf("Key %d too long to forward\n", key);
+                        failed++;
+                    }
+                    else
+                    {
+                        forwardMessage(message);
+                        forwarded++;
+                    }
+                }
+                pthread_rwlock_unlock(&ownershipLock);
+            }
+            // Tell the importer how the batch went
+            char message[BUFFER_SIZE];
+            snprintf(message, sizeof(message), "ack %d %d %d", stored, forwarded, failed);
+            sendMessage(clientFD, message, strlen(message));
+        }
+        else if (strcmp("getLoad", command) == 0)
+        {
+            char message[BUFFER_SIZE];
+            snprintf(message, sizeof(message), "%lu", nodeLoad());
+            sendMessage(clientFD, message, strlen(message));
+        }
+        else if (strcmp("lookupNext", command) == 0)
+        {
+            int key, originPort;
+            unsigned long id = 0;
+            unsigned long long budget = 0;
+            char traversedList[BUFFER_SIZE];
+            char originAddress[INET_ADDRSTRLEN];
+            sscanf(inputBuffer, "%*s %d %s %d %15s %lu %llu", &key, traversedList, &originPort, originAddress, &id, &budget);
+            snprintf(traversedList + strlen(traversedList), sizeof(traversedList) - strlen(traversedList), ",%d", range[1]);
+            long long left = remainingBudget(budget, receivedAt);
+            if (left < 0)
+            {
+                // Nobody is waiting on this any more
+                expiredDropped++;
+                continue;
+            }
+
+            // Perform lookup
+            if (inRange(key))
+            {
+                hits[key]++;
+                char message[BUFFER_SIZE];
+                char value[BUFFER_SIZE];
+                if (!getValue(key, value))
+                {
+                    snprintf(message, sizeof(message), "PRINT %lu Key not found\nTraversed: %s\nFinal response obtained: %d\n", id, traversedList, range[1]);
+                }
+                else
+                {
+                    snprintf(message, sizeof(message), "PRINT %lu Key: %d Value: %s\nTraversed: %s\nFinal response obtained: %d\n", id, key, value, traversedList, range[1]);
+                }
+                sendResult(originAddress, originPort, message);
+            }
+            else
+            {
+                // pass this message along to the successor
+                char message[BUFFER_SIZE];
+                if (snprintf(message, sizeof(message), "%s %d %s %d %s %lu %lld", "lookupNext", key, traversedList, originPort, originAddress, id, left) >= (int)sizeof(message))
+                {
+                    rejectTooLong(originAddress, originPort, id);
+                }
+                else
+                {
+                    forwardMessage(message);
+                }
+            }
+        }
+        else if (strcmp("PRINT", command) == 0)
+        {
+            // Everything after "PRINT id " is the result
+            unsigned long id;
+            int offset;
+            if (sscanf(inputBuffer, "%*s %lu %n", &id, &offset) != 1)
+            {
+                continue;
+            }
+            if (id == 0)
+            {
+                // Replies to import records we forwarded carry no id and nobody waits on them,
+                // but a record that couldn't be stored still has to be reported
+                if (strstr(inputBuffer + offset, "Insert failed") != NULL || strstr(inputBuffer + offset, "too long") != NULL)
+                {
+                    printf("%s", inputBuffer + offset);
+                }
+            }
+            else
+            {
+                completePending(id, inputBuffer + offset);
+            }
+        }
+        else if (strcmp("inserting", command) == 0)
+        {
+            int key, originPort;
+            unsigned long id = 0;
+            unsigned long long budget = 0;
+            char value[BUFFER_SIZE];
+            char traversedList[BUFFER_SIZE];
+            char originAddress[INET_ADDRSTRLEN];
+            unsigned long ttl = 0;
+            sscanf(inputBuffer, "%*s %d %s %s %lu %d %15s %lu %llu", &key, value, traversedList, &ttl, &originPort, originAddress, &id, &budget);
+            snprintf(traversedList + strlen(traversedList), sizeof(traversedList) - strlen(traversedList), ",%d", range[1]);
+            long long left = remainingBudget(budget, receivedAt);
+            if (left < 0)
+            {
+                // Nobody is waiting on this any more
+                expiredDropped++;
+                continue;
+            }
+
+            // Perform insert
+            pthread_rwlock_rdlock(&ownershipLock);
+            if (inRange(key))
+            {
+                hits[key]++;
+                char message[BUFFER_SIZE];
+                if (insert(key, value, ttl) < 0)
+                {
+                    snprintf(message, sizeof(message), "PRINT %lu Key: %d Insert failed: out of memory\nTraversed: %s\nFailed at: %d\n", id, key, traversedList, range[1]);
+                }
+                else
+                {
+                    snprintf(message, sizeof(message), "PRINT %lu Key: %d Value: %s Insert\nTraversed: %s\nInserted at: %d\n", id, key, value, traversedList, range[1]);
+                }
+                migrateWrite(key);
+                sendResult(originAddress, originPort, message);
+            }
+            else
+            {
+                // pass this message along to the successor
+                char message[BUFFER_SIZE];
+                if (snprintf(message, sizeof(message), "%s %d %s %s %lu %d %s %lu %lld", "inserting", key, value, traversedList, ttl, originPort, originAddress, id, left) >= (int)sizeof(message))
+                {
+                    rejectTooLong(originAddress, originPort, id);
+                }
+                else
+                {
+                    forwardMessage(message);
+                }
+            }
+            pthread_rwlock_unlock(&ownershipLock);
+        }
+        else if (strcmp("deleting", command) == 0)
+        {
+            int key, originPort;
+            unsigned long id = 0;
+            unsigned long long budget = 0;
+            char traversedList[BUFFER_SIZE];
+            char originAddress[INET_ADDRSTRLEN];
+            sscanf(inputBuffer, "%*s %d %s %d %15s %lu %llu", &key, traversedList, &originPort, originAddress, &id, &budget);
+            snprintf(traversedList + strlen(traversedList), sizeof(traversedList) - strlen(traversedList), ",%d", range[1]);
+            long long left = remainingBudget(budget, receivedAt);
+            if (left < 0)
+            {
+                // Nobody is waiting on this any more
+                expiredDropped++;
+                continue;
+            }
+
+            // Perform delete
+            pthread_rwlock_rdlock(&ownershipLock);
+            if (inRange(key))
+            {
+                hits[key]++;
+                char message[BUFFER_SIZE];
+                char value[BUFFER_SIZE];
+                if (!delete (key, value))
+                {
+                    snprintf(message, sizeof(message), "PRINT %lu Key not found\nTraversed: %s\nFailed at: %d\n", id, traversedList, range[1]);
+                }
+                else
+                {
+                    snprintf(message, sizeof(message), "PRINT %lu Key: %d Value: %s Successful Deletion\nTraversed: %s\nDeleted at: %d\n", id, key, value, traversedList, range[1]);
+                    migrateWrite(key);
+                }
+                sendResult(originAddress, originPort, message);
+            }
+            else
+            {
+                // pass along to successor
+                char message[BUFFER_SIZE];
+                if (snprintf(message, sizeof(message), "%s %d %s %d %s %lu %lld", "deleting", key, traversedList, originPort, originAddress, id, left) >= (int)sizeof(message))
+                {
+                    rejectTooLong(originAddress, originPort, id);
+                }
+                else
+                {
+                    forwardMessage(message);
+                }
+            }
+            pthread_rwlock_unlock(&ownershipLock);
+        }
+    }
+}
+
+// Handles a lookup, insert or delete typed in at this node. Tag is the input line for batch commands, 0 otherwise.
+// Keys in our range are answered right here. Anything else is sent around the ring
+// tagged with our address, and the owner sends the result straight back to us.
+// Every call prints exactly one result through printResult, here or when the reply comes back.
+void clientCommand(char *command, char *inputBuffer, int tag)
+{
+    char result[BUFFER_SIZE];
+    if (!inRing)
+    {
+        printResult(tag, "Not in the ring, enter first\n");
+        return;
+    }
+    int key;
+    if (sscanf(inputBuffer, "%*s %d", &key) != 1 || key < 0 || key >= HASH_SPACE)
+    {
+        printResult(tag, "Invalid key\n");
+        return;
+    }
+
+    char traversedList[BUFFER_SIZE];
+    snprintf(traversedList, sizeof(traversedList), "%d", range[1]);
+    char message[BUFFER_SIZE];
+
+    if (strcmp("lookup", command) == 0)
+    {
+        // Perform lookup
+        if (inRange(key))
+        {
+            hits[key]++;
+            char value[BUFFER_SIZE];
+            if (!getValue(key, value))
+            {
+                snprintf(result, sizeof(result), "Key not found\nTraversed: %s\nFinal response obtained: %d\n", traversedList, range[1]);
+            }
+            else
+            {
+                snprintf(result, sizeof(result), "Key: %d Value: %s\nTraversed: %s\nFinal response obtained: %d\n", key, value, traversedList, range[1]);
+            }
+            printResult(tag, result);
+        }
+        else
+        {
+            // pass this message along to the successor
+            // Lookups are safe to send twice, so a slow one gets hedged
+            unsigned long long budget;
+            unsigned long id = addPending(tag, key, &budget);
+            if (snprintf(message, sizeof(message), "%s %d %s %d %s %lu %llu", "lookupNext", key, traversedList, port, myIP, id, budget) >= (int)sizeof(message))
+            {
+                cancelPending(id);
+                printResult(tag, "Request too long to send\n");
+                return;
+            }
+            armHedge(id, message);
+            forwardMessage(message);
+        }
+    } // lookup
+    else if (strcmp("insert", command) == 0)
+    {
+        char value[BUFFER_SIZE];
+        char ttlText[BUFFER_SIZE];
+        unsigned long ttl = 0;
+        int fields = sscanf(inputBuffer, "%*s %*d %s %s", value, ttlText);
+        if (fields < 1)
+        {
+            printResult(tag, "Usage: insert key value [ttl]\n");
+            return;
+        }
+        if (fields == 2 && !parseTTL(ttlText, strlen(ttlText), &ttl))
+        {
+            printResult(tag, "Invalid ttl\n");
+            return;
+        }
+        // Perform insert
+        pthread_rwlock_rdlock(&ownershipLock);
+        if (inRange(key))
+        {
+            hits[key]++;
+            if (insert(key, value, ttl) < 0)
+            {
+                snprintf(result, sizeof(result), "Key: %d Insert failed: out of memory\nTraversed: %s\nInserted at: %d\n", key, traversedList, range[1]);
+            }
+            else
+            {
+                snprintf(result, sizeof(result), "Key: %d Value: %s Insert\nTraversed: %s\nInserted at: %d\n", key, value, traversedList, range[1]);
+            }
+            migrateWrite(key);
+            printResult(tag, result);
+        }
+        else
+        {
+            // pass this message along to the successor
+            // Writes are not hedged, a late copy could land after a newer write to the same key
+            unsigned long long budget;
+            unsigned long id = addPending(tag, key, &budget);
+            if (snprintf(message, sizeof(message), "%s %d %s %s %lu %d %s %lu %llu", "inserting", key, value, traversedList, ttl, port, myIP, id, budget) >= (int)sizeof(message))
+            {
+                cancelPending(id);
+                printResult(tag, "Value too long to send\n");
+            }
+            else
+            {
+                forwardMessage(message);
+            }
+        }
+        pthread_rwlock_unlock(&ownershipLock);
+    } // insert
+    else if (strcmp("delete", command) == 0)
+    {
+        // Perform delete
+        pthread_rwlock_rdlock(&ownershipLock);
+        if (inRange(key))
+        {
+            hits[key]++;
+            char value[BUFFER_SIZE];
+            if (!delete (key, value))
+            {
+                snprintf(result, sizeof(result), "Key not found\nTraversed: %s\nDeleted at: %d\n", traversedList, range[1]);
+            }
+            else
+            {
+                snprintf(result, sizeof(result), "Key: %d Value: %s Successful Deletion\nTraversed: %s\nDeleted at: %d\n", key, value, traversedList, range[1]);
+                migrateWrite(key);
+            }
+            printResult(tag, result);
+        }
+        else
+        {
+            // pass along to successor
+            unsigned long long budget;
+            unsigned long id = addPending(tag, key, &budget);
+            if (snprintf(message, sizeof(message), "%s %d %s %d %s %lu %llu", "deleting", key, traversedList, port, myIP, id, budget) >= (int)sizeof(message))
+            {
+                cancelPending(id);
+                printResult(tag, "Request too long to send\n");
+            }
+            else
+            {
+                forwardMessage(message);
+            }
+        }
+        pthread_rwlock_unlock(&ownershipLock);
+    } // delete
+}
+
+// Runs every lookup, insert and delete in input, one per line, without waiting for each to finish.
+// Up to MAX_IN_FLIGHT are out around the ring at once and results are printed tagged with their line number.
+void runBatch(FILE *input)
+{
+    struct timespec start, now;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    char line[BUFFER_SIZE];
+    int lineNumber = 0;
+    int commands = 0;
+    int lost = 0;
+    while (fgets(line, sizeof(line), input) != NULL)
+    {
+        lineNumber++;
+        if (strchr(line, '\n') == NULL && strlen(line) == sizeof(line) - 1)
+        {
+            // fgets stopped at the end of the buffer. Unless the line ends right there, skip the rest
+            // of it rather than running it as the next command.
+            int c = fgetc(input);
+            if (c != '\n' && c != EOF)
+            {
+                while (c != '\n' && c != EOF)
+                {
+                    c = fgetc(input);
+                }
+                printf("[%d] Line too long\n", lineNumber);
+                continue;
+            }
+        }
+        char command[BUFFER_SIZE];
+        if (sscanf(line, "%s", command) != 1)
+        {
+            continue;
+        }
+        if (strcmp("lookup", command) != 0 && strcmp("insert", command) != 0 && strcmp("delete", command) != 0)
+        {
+            printf("[%d] Unknown command %s\n", lineNumber, command);
+            continue;
+        }
+
+        // Wait for a free slot. Replies that never come are given up on so the batch can't stall.
+        pthread_mutex_lock(&batchLock);
+        while (inFlight >= MAX_IN_FLIGHT)
+        {
+            int before = inFlight;
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += BATCH_REPLY_TIMEOUT;
+            if (pthread_cond_timedwait(&batchCond, &batchLock, &deadline) != 0 && inFlight == before)
+            {
+                lost += inFlight;
+                inFlight = 0;
+            }
+        }
+        inFlight++;
+        pthread_mutex_unlock(&batchLock);
+
+        clientCommand(command, line, lineNumber);
+        commands++;
+    }
+
+    // Wait for the stragglers
+    pthread_mutex_lock(&batchLock);
+    while (inFlight > 0)
+    {
+        int before = inFlight;
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += BATCH_REPLY_TIMEOUT;
+        if (pthread_cond_timedwait(&batchCond, &batchLock, &deadline) != 0 && inFlight == before)
+        {
+            lost += inFlight;
+            inFlight = 0;
+        }
+    }
+    pthread_mutex_unlock(&batchLock);
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long elapsed = (now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000;
+    printf("Batch done: %d commands in %ld ms\n", commands, elapsed);
+    if (lost > 0)
+    {
+        printf("No reply to %d commands\n", lost);
+    }
+}
+
+// Runs a batch from the file named in the batch command, or from the rest of stdin if there isn't one.
+void batchCommand(char *inputBuffer)
+{
+    char path[BUFFER_SIZE];
+    if (sscanf(inputBuffer, "%*s %s", path) != 1)
+    {
+        runBatch(stdin);
+        return;
+    }
+    FILE *file = fopen(path, "r");
+    if (file == NULL)
+    {
+        printf("No File\n");
+        return;
+    }
+    runBatch(file);
+    fclose(file);
+}
+
+// Handles "hedge <percentile|off>" and "deadline <ms>", which tune how requests from this node are hedged and timed out.
+void tuneCommand(char *command, char *inputBuffer)
+{
+    char setting[BUFFER_SIZE];
+    if (sscanf(inputBuffer, "%*s %s", setting) != 1)
+    {
+        printf("Usage: hedge <percentile|off> or deadline <ms>\n");
+        return;
+    }
+    if (strcmp("deadline", command) == 0)
+    {
+        unsigned long deadline = strtoul(setting, NULL, 10);
+        if (deadline == 0)
+        {
+            printf("Invalid deadline\n");
+            return;
+        }
+        deadlineMillis = deadline;
+        printf("Requests time out after %lu ms\n", deadlineMillis);
+        return;
+    }
+    if (strcmp("off", setting) == 0)
+    {
+        hedgePercentile = 0;
+        printf("Hedging off\n");
+        return;
+    }
+    int percentile = atoi(setting);
+    if (percentile <= 0 || percentile > 100)
+    {
+        printf("Invalid percentile\n");
+        return;
+    }
+    hedgePercentile = percentile;
+    updateHedgeDelay();
+    pthread_mutex_lock(&pendingLock);
+    pthread_cond_signal(&pendingCond);
+    pthread_mutex_unlock(&pendingLock);
+    printf("Hedging lookups after the p%d latency\n", hedgePercentile);
+}
+
+// Maps the file at path read only. Returns NULL if it can't be opened or is empty.
+char *mapFile(char *path, size_t *length)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        return NULL;
+    }
+    struct stat info;
+    if (fstat(fd, &info) < 0 || info.st_size == 0)
+    {
+        close(fd);
+        return NULL;
+    }
+    char *data = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+    {
+        return NULL;
+    }
+    madvise(data, info.st_size, MADV_SEQUENTIAL);
+    *length = info.st_size;
+    return data;
+}
+
+// Appends length bytes of record lines to node's buffer.
+void appendRecords(ringNodeStruct *node, char *records, size_t length)
+{
+    if (node->length + length > node->capacity)
+    {
+        node->capacity = (node->length + length) * 2;
+        node->data = realloc(node->data, node->capacity);
+    }
+    memcpy(node->data + node->length, records, length);
+    node->length += length;
+}
+
+// Walks the successor links from this node and fills nodes with every member's range.
+// Returns the number of nodes found.
+int collectRing(ringNodeStruct *nodes)
+{
+    char address[INET_ADDRSTRLEN];
+    strcpy(address, myIP);
+    int nodePort = port;
+
+    int count = 0;
+    while (count < MAX_RING_NODES)
+    {
+        int fd = create_connection(address, nodePort);
+        if (fd < 0)
+        {
+            break;
+        }
+        sendMessage(fd, "getRange", strlen("getRange"));
+        char inputBuffer[BUFFER_SIZE];
+        readMessage(fd, inputBuffer);
+        close(fd);
+
+        ringNodeStruct *node = &nodes[count];
+        memset(node, 0, sizeof(ringNodeStruct));
+        strcpy(node->address, address);
+        node->port = nodePort;
+        if (sscanf(inputBuffer, "%d %d %d %15s", &node->lo, &node->hi, &nodePort, address) != 4)
+        {
+            break;
+        }
+        count++;
+        if (nodePort == port && strcmp(address, myIP) == 0)
+        {
+            break;
+        }
+    }
+    return count;
+}
+
+// Index of the node in nodes whose range holds key.
+int findOwner(ringNodeStruct *nodes, int count, int key)
+{
+    for (int i = 0; i < count; i++)
+    {
+        if (nodes[i].lo <= nodes[i].hi ? nodes[i].lo <= key && key <= nodes[i].hi : key >= nodes[i].lo || key <= nodes[i].hi)
         {
-            int key;
-            char traversedList[BUFFER_SIZE];
-            sscanf(inputBuffer, "%*s %d %s", &key, traversedList);
+            return i;
+        }
+    }
+    return 0;
+}
 
-            // Perform lookup
-            if (key >= range[0] && key <= range[1])
-            {
-                if (values[key] == NULL)
-                {
-                    char message[BUFFER_SIZE];
-                    snprintf(message, sizeof(message), "PRINT Key not found\nTraversed: %s,%d\nFinal response obtained: %d\n", traversedList, range[1], range[1]);
-                    write(bootstrapFD, message, strlen(message));
-                }
-                else
-                {
-                    char message[BUFFER_SIZE];
-                    snprintf(message, sizeof(message), "PRINT Key: %d Value: %s\nTraversed: %s,%d\nFinal response obtained: %d\n", key, values[key], traversedList, range[1], range[1]);
-                    write(bootstrapFD, message, strlen(message));
-                }
-            }
-            else
+// Thread method sending one node its share of an import, in batches of whole lines.
+void *importNode(void *arg)
+{
+    ringNodeStruct *node = (ringNodeStruct *)arg;
+    int fd = create_connection(node->address, node->port);
+    if (fd < 0)
+    {
+        node->failed = node->count;
+        return NULL;
+    }
+    char inputBuffer[BUFFER_SIZE];
+    size_t offset = 0;
+    while (offset < node->length)
+    {
+        char message[BUFFER_SIZE];
+        int length = snprintf(message, sizeof(message), "importBatch\n");
+        int records = 0;
+        while (offset < node->length)
+        {
+            char *lineEnd = memchr(node->data + offset, '\n', node->length - offset);
+            size_t lineLength = lineEnd - (node->data + offset) + 1;
+            if (length + lineLength >= BUFFER_SIZE - 1)
             {
-                // pass this message along to the successor non bootstrap server
-                // add current server id to the traversed server id list
-                write(successorFD, "getID", strlen("getID"));
-                readAmount = read(successorFD, inputBuffer, BUFFER_SIZE);
-                inputBuffer[readAmount] = '\0';
-                int id;
-                sscanf(inputBuffer, "%*s %d", &id);
-                if (id == 0)
-                {
-                    char message[BUFFER_SIZE];
-                    snprintf(message, sizeof(message), "PRINT Key not found\nTraversed: %s,%d\nFinal response obtained: %d\n", traversedList, range[1], range[1]);
-                    write(bootstrapFD, message, strlen(message));
-                }
-                else
+                if (length == (int)strlen("importBatch\n"))
                 {
-                    snprintf(traversedList + strlen(traversedList), sizeof(traversedList) - strlen(traversedList), ",%d", range[1]);
-                    char command2[BUFFER_SIZE] = "lookupNext";
-                    char message[BUFFER_SIZE];
-                    snprintf(message, sizeof(message), "%s %d %s", command2, key, traversedList);
-                    write(successorFD, message, strlen(message));
+                    // Too long for any batch, importFile should have left it out
+                    offset += lineLength;
+                    node->count--;
+                    node->skipped++;
+                    continue;
                 }
+                break;
             }
+            memcpy(message + length, node->data + offset, lineLength);
+            length += lineLength;
+            offset += lineLength;
+            records++;
         }
-        else if (strcmp("PRINT", command) == 0)
+        if (records > 0)
         {
-            char *message = strstr(inputBuffer, "PRINT ");
-            if (message != NULL)
+            int stored, forwarded, failed;
+            if (sendMessage(fd, message, length) < 0 || readMessage(fd, inputBuffer) <= 0 ||
+                sscanf(inputBuffer, "ack %d %d %d", &stored, &forwarded, &failed) != 3)
             {
-                message += strlen("PRINT "); // Move the pointer past "PRINT "
-                printf("%s\n", message);     // Print everything after "PRINT "
+                // The node went away, nothing from this batch on can be counted as imported
+                node->failed += node->count - node->stored - node->forwarded - node->failed;
+                break;
             }
+            node->stored += stored;
+            node->forwarded += forwarded;
+            node->failed += failed;
         }
+    }
+    close(fd);
+    return NULL;
+}
 
-        else if (strcmp("inserting", command) == 0)
+// Thread method pulling every key one node owns for a dump.
+void *dumpNode(void *arg)
+{
+    ringNodeStruct *node = (ringNodeStruct *)arg;
+    int fd = create_connection(node->address, node->port);
+    if (fd < 0)
+    {
+        return NULL;
+    }
+    sendMessage(fd, "dumpRange", strlen("dumpRange"));
+    char inputBuffer[BUFFER_SIZE];
+    while (readMessage(fd, inputBuffer) > 0 && strncmp(inputBuffer, "batch\n", strlen("batch\n")) == 0)
+    {
+        char *records = inputBuffer + strlen("batch\n");
+        for (char *c = records; *c != '\0'; c++)
         {
-            int key;
-            char value[BUFFER_SIZE];
-            char traversedList[BUFFER_SIZE];
-            sscanf(inputBuffer, "%*s %d %s %s", &key, value, traversedList);
-            // Perform insert
-            if (key >= range[0] && key <= range[1])
-            {
-                insert(key, value);
-                char message[BUFFER_SIZE];
-                snprintf(message, sizeof(message), "PRINT Key: %d Value: %s Insert\nTraversed: %s,%d\nInserted at: %d\n", key, values[key], traversedList, range[1], range[1]);
-                write(bootstrapFD, message, strlen(message));
-            }
-            else
-            {
-                write(successorFD, "getID", strlen("getID"));
-                readAmount = read(successorFD, inputBuffer, BUFFER_SIZE);
-                inputBuffer[readAmount] = '\0';
-                int id;
-                sscanf(inputBuffer, "%d", &id);
-                if (id == 0)
-                {
-                    printf("Key not found\n");
-                    printf("Traversed: %s,%d\n", traversedList, range[1]);
-                    printf("Final response obtained: %d\n", range[1]);
-                }
-                // pass this message along to the successor
-                snprintf(traversedList + strlen(traversedList), sizeof(traversedList) - strlen(traversedList), ",%d", range[1]);
-                char command2[BUFFER_SIZE] = "inserting";
-                char message[BUFFER_SIZE];
-                snprintf(message, sizeof(message), "%s %d %s %s", command2, key, value, traversedList);
-                write(successorFD, message, strlen(message));
-            }
+            node->count += *c == '\n';
         }
+        appendRecords(node, records, strlen(records));
+        sendMessage(fd, "ack", strlen("ack"));
+    }
+    sscanf(inputBuffer, "EOF %d", &node->skipped);
+    close(fd);
+    return NULL;
+}
 
-        else if (strcmp("deleting", command) == 0)
+// Loads the "key value [ttl]" records in path into the whole ring.
+// Records are split up by owner first, then every node gets its share over its own connection in parallel.
+void importFile(char *path)
+{
+    size_t fileLength;
+    char *data = mapFile(path, &fileLength);
+    if (data == NULL)
+    {
+        printf("No File\n");
+        return;
+    }
+
+    ringNodeStruct nodes[MAX_RING_NODES];
+    int count = collectRing(nodes);
+
+    char *cursor = data;
+    int key;
+    char value[BUFFER_SIZE];
+    unsigned long ttl;
+    int total = 0;
+    int skipped = 0;
+    while (parseRecord(&cursor, data + fileLength, &key, value, &ttl))
+    {
+        char record[BUFFER_SIZE + 64];
+        int length = ttl > 0 ? snprintf(record, sizeof(record), "%d %s %lu\n", key, value, ttl) : snprintf(record, sizeof(record), "%d %s\n", key, value);
+        if (length >= BUFFER_SIZE - 1 - (int)strlen("importBatch\n"))
         {
-            int key;
-            char traversedList[BUFFER_SIZE];
-            sscanf(inputBuffer, "%*s %d %s", &key, traversedList);
-            // Perform delete
-            if (key >= range[0] && key <= range[1])
-            {
-                if (values[key] == NULL)
-                {
-                    char message[BUFFER_SIZE];
-                    snprintf(message, sizeof(message), "PRINT Key not found\nTraversed: %s,%d\nFailed at: %d\n", traversedList, range[1], range[1]);
-                    write(bootstrapFD, message, strlen(message));
-                }
-                else
-                {
-                    char message[BUFFER_SIZE];
-                    snprintf(message, sizeof(message), "PRINT Key: %d Value: %s Successful Deletion\nTraversed: %s,%d\nDeleted at: %d\n", key, values[key], traversedList, range[1], range[1]);
-                    delete (key);
-                    write(bootstrapFD, message, strlen(message));
-                }
-            }
-            else
-            {
-                write(successorFD, "getID", strlen("getID"));
-                readAmount = read(successorFD, inputBuffer, BUFFER_SIZE);
-                inputBuffer[readAmount] = '\0';
-                int id;
-                sscanf(inputBuffer, "%d", &id);
-                if (id == 0)
-                {
-                    char message[BUFFER_SIZE];
-                    snprintf(message, sizeof(message), "PRINT Key not found\nTraversed: %s,%d\nFinal response obtained: %d\n", traversedList, range[1], range[1]);
-                    write(bootstrapFD, message, strlen(message));
-                }
-                // pass along to successor
-                snprintf(traversedList + strlen(traversedList), sizeof(traversedList) - strlen(traversedList), ",%d", range[1]);
-                char command2[BUFFER_SIZE] = "deleting";
-                char message[BUFFER_SIZE];
-                snprintf(message, sizeof(message), "%s %d %s", command2, key, traversedList);
-                write(successorFD, message, strlen(message));
-            }
+            // Every batch has to carry at least one whole record
+            skipped++;
+            continue;
         }
+        ringNodeStruct *node = &nodes[findOwner(nodes, count, key)];
+        appendRecords(node, record, length);
+        node->count++;
+        total++;
+    }
+    munmap(data, fileLength);
+
+    pthread_t threads[MAX_RING_NODES];
+    for (int i = 0; i < count; i++)
+    {
+        pthread_create(&threads[i], NULL, importNode, &nodes[i]);
+    }
+    int stored = 0;
+    int forwarded = 0;
+    int failed = 0;
+    for (int i = 0; i < count; i++)
+    {
+        pthread_join(threads[i], NULL);
+        printf("Node %d: %d keys stored, %d forwarded, %d failed\n", nodes[i].hi, nodes[i].stored, nodes[i].forwarded, nodes[i].failed);
+        stored += nodes[i].stored;
+        forwarded += nodes[i].forwarded;
+        failed += nodes[i].failed;
+        skipped += nodes[i].skipped;
+        free(nodes[i].data);
+    }
+    printf("Imported %d of %d keys into %d nodes\n", stored + forwarded, total, count);
+    if (forwarded > 0)
+    {
+        printf("Forwarded %d keys that had moved to their new owners\n", forwarded);
+    }
+    if (failed > 0)
+    {
+        printf("Failed to import %d keys\n", failed);
+    }
+    if (skipped > 0)
+    {
+        printf("Skipped %d records too long to send\n", skipped);
+    }
+}
+
+// Writes every key in the ring to path as "key value [ttl]" records, pulling from all nodes in parallel.
+// The file can be loaded back with import or used as the bootstrap config's key list.
+void dumpFile(char *path)
+{
+    FILE *file = fopen(path, "w");
+    if (file == NULL)
+    {
+        printf("Can't open %s\n", path);
+        return;
+    }
+
+    ringNodeStruct nodes[MAX_RING_NODES];
+    int count = collectRing(nodes);
+
+    pthread_t threads[MAX_RING_NODES];
+    for (int i = 0; i < count; i++)
+    {
+        pthread_create(&threads[i], NULL, dumpNode, &nodes[i]);
+    }
+    int total = 0;
+    int skipped = 0;
+    for (int i = 0; i < count; i++)
+    {
+        pthread_join(threads[i], NULL);
+        fwrite(nodes[i].data, 1, nodes[i].length, file);
+        total += nodes[i].count;
+        skipped += nodes[i].skipped;
+        free(nodes[i].data);
+    }
+    fclose(file);
+    printf("Dumped %d keys from %d nodes\n", total, count);
+    if (skipped > 0)
+    {
+        printf("Skipped %d keys with values too long to send\n", skipped);
+    }
+}
+
+// Shared handling of the dump and import commands from either user thread.
+void bulkCommand(char *command, char *inputBuffer)
+{
+    if (!inRing)
+    {
+        printf("Not in the ring, enter first\n");
+        return;
+    }
+    char path[BUFFER_SIZE];
+    if (sscanf(inputBuffer, "%*s %s", path) != 1)
+    {
+        printf("Usage: %s file\n", command);
+        return;
+    }
+    if (strcmp("dump", command) == 0)
+    {
+        dumpFile(path);
+    }
+    else
+    {
+        importFile(path);
     }
 }
 
@@ -563,140 +3024,38 @@ void bootstrapMain()
     char inputBuffer[BUFFER_SIZE];
     while (1)
     {
-        int readAmount = 0;
-        readAmount = read(0, inputBuffer, BUFFER_SIZE);
-        inputBuffer[readAmount] = '\0';
-        // printf(inputBuffer);
-        if (readAmount == 0)
+        // One command per line, however many lines arrive at once
+        if (fgets(inputBuffer, BUFFER_SIZE, stdin) == NULL)
         {
             return;
         }
 
         char command[BUFFER_SIZE];
-        sscanf(inputBuffer, "%s", command);
+        if (sscanf(inputBuffer, "%s", command) != 1)
+        {
+            continue;
+        }
         // printf(inputBuffer);
-        if (strcmp("lookup", command) == 0)
+        if (strcmp("lookup", command) == 0 || strcmp("insert", command) == 0 || strcmp("delete", command) == 0)
         {
-            // printf("Here in lookup bs main\n");
-            int key;
-            sscanf(inputBuffer, "%*s %d", &key);
-            // printf("Key after scan: %d\n", key);
-            // Perform lookup
-            if (key == 0 || key >= range[0])
-            {
-                if (values[key] == NULL)
-                {
-                    printf("Key not found\n");
-                    printf("Traversed: 0\n");
-                    printf("Final response obtained: 0\n");
-                }
-                else
-                {
-                    printf("Key: %d Value: %s\n", key, values[key]);
-                    printf("Traversed: 0\n");
-                    printf("Final response obtained: 0\n");
-                }
-            }
-            else
-            {
-                // pass this message along to the successor non bootstrap server
-                // add current server id to the traversed server id list
-                write(successorFD, "getID", strlen("getID"));
-                readAmount = read(successorFD, inputBuffer, BUFFER_SIZE);
-                inputBuffer[readAmount] = '\0';
-                int id;
-                sscanf(inputBuffer, "%d", &id);
-                if (id == 0)
-                {
-                    printf("Key not found\n");
-                    printf("Traversed: 0\n");
-                    printf("Final response obtained: 0\n");
-                }
-                else
-                {
-                    char traversedList[BUFFER_SIZE] = "0";
-                    char command2[BUFFER_SIZE] = "lookupNext";
-                    char message[BUFFER_SIZE];
-                    snprintf(message, sizeof(message), "%s %d %s", command2, key, traversedList);
-                    write(successorFD, message, strlen(message));
-                }
-            }
-        } // lookup
-        else if (strcmp("insert", command) == 0)
+            clientCommand(command, inputBuffer, 0);
+        }
+        else if (strcmp("batch", command) == 0)
         {
-            int key;
-            char value[BUFFER_SIZE];
-            sscanf(inputBuffer, "%*s %d %s", &key, value);
-            // Perform insert
-            if (key == 0 || key >= range[0])
-            {
-                insert(key, value);
-                printf("Key: %d Value: %s Insert\n", key, values[key]);
-                printf("Traversed: 0\n");
-                printf("Inserted at: 0\n");
-            }
-            else
-            {
-                write(successorFD, "getID", strlen("getID"));
-                readAmount = read(successorFD, inputBuffer, BUFFER_SIZE);
-                inputBuffer[readAmount] = '\0';
-                int id;
-                sscanf(inputBuffer, "%d", &id);
-                if (id == 0)
-                {
-                    printf("Key not found\n");
-                    printf("Traversed: 0\n");
-                    printf("Final response obtained: 0\n");
-                }
-                // pass this message along to the successor
-                char traversedList[BUFFER_SIZE] = "0";
-                char command2[BUFFER_SIZE] = "inserting";
-                char message[BUFFER_SIZE];
-                snprintf(message, sizeof(message), "%s %d %s %s", command2, key, value, traversedList);
-                write(successorFD, message, strlen(message));
-            }
-        } // insert
-        else if (strcmp("delete", command) == 0)
+            batchCommand(inputBuffer);
+        }
+        else if (strcmp("hedge", command) == 0 || strcmp("deadline", command) == 0)
         {
-            // TODO: IMPLEMENT PROPERLY
-            int key;
-            sscanf(inputBuffer, "%*s %d", &key);
-            // Perform delete
-            if (key == 0 || key >= range[0])
-            {
-                if (values[key] == NULL)
-                {
-                    printf("Key not found\n");
-                }
-                else
-                {
-                    printf("Key: %d Value: %s Successful Deletion\n", key, values[key]);
-                    delete (key);
-                }
-                printf("Traversed: 0\n");
-                printf("Deleted at: 0\n");
-            }
-            else
-            {
-                write(successorFD, "getID", strlen("getID"));
-                readAmount = read(successorFD, inputBuffer, BUFFER_SIZE);
-                inputBuffer[readAmount] = '\0';
-                int id;
-                sscanf(inputBuffer, "%d", &id);
-                if (id == 0)
-                {
-                    printf("Key not found\n");
-                    printf("Traversed: 0\n");
-                    printf("Final response obtained: 0\n");
-                }
-                // pass along to successor
-                char traversedList[BUFFER_SIZE] = "0";
-                char command2[BUFFER_SIZE] = "deleting";
-                char message[BUFFER_SIZE];
-                snprintf(message, sizeof(message), "%s %d %s", command2, key, traversedList);
-                write(successorFD, message, strlen(message));
-            }
-        } // delete
+            tuneCommand(command, inputBuffer);
+        }
+        else if (strcmp("dump", command) == 0 || strcmp("import", command) == 0)
+        {
+            bulkCommand(command, inputBuffer);
+        }
+        else if (strcmp("stats", command) == 0)
+        {
+            printStats();
+        } // stats
     }
 }
 
@@ -705,109 +3064,161 @@ void nameServerMain()
 {
     printf("here in name server main\n");
     char inputBuffer[BUFFER_SIZE];
-    pthread_t thread;
-    int running = 1;
-    while (running == 1)
+    while (1)
     {
-        int readAmount = 0;
-        readAmount = read(0, inputBuffer, BUFFER_SIZE);
-        inputBuffer[readAmount] = '\0';
-        if (readAmount == 0)
+        // One command per line, however many lines arrive at once
+        if (fgets(inputBuffer, BUFFER_SIZE, stdin) == NULL)
         {
             return;
         }
-        
+
         char command[BUFFER_SIZE];
-        sscanf(inputBuffer, "%s", command);
+        if (sscanf(inputBuffer, "%s", command) != 1)
+        {
+            continue;
+        }
 
         if (strcmp("enter", command) == 0)
         {
-            // Create the connection to the bootstrap server
-            bootstrapFD = create_connection(bootstrapAddress, bootstrapPort);
-    
-            // send info to bootstrap server
-            // needs id, port, address
-            char myIP[INET_ADDRSTRLEN]; // INET_ADDRSTRLEN = 16 bytes, enough for IPv4 string
-            get_local_ip(myIP);
+            // We can join through any node already in the ring. Defaults to the bootstrap server.
+            char memberAddress[INET_ADDRSTRLEN];
+            int memberPort;
+            if (sscanf(inputBuffer, "%*s %15s %d", memberAddress, &memberPort) != 2)
+            {
+                strcpy(memberAddress, bootstrapAddress);
+                memberPort = bootstrapPort;
+            }
 
+            // send info to the ring member
+            // needs id, port, address
             char message[BUFFER_SIZE];
             snprintf(message, sizeof(message), "%s %d %d %s", command, range[1], port, myIP);
             // printf("%s\n", message);
-            write(bootstrapFD, message, strlen(message));
-
-            struct sockaddr_in clientAddr;
-            socklen_t clientAddrlen = sizeof(clientAddr);
-            if ((predecessorFD = accept(socketFD, (struct sockaddr *)&clientAddr, &clientAddrlen)) < 0)
+            int memberFD = create_connection(memberAddress, memberPort);
+            if (memberFD < 0)
             {
-                perror("Accept failed");
-                exit(EXIT_FAILURE);
+                printf("Can't reach %s:%d\n", memberAddress, memberPort);
+                continue;
             }
-            // spin off thread to listen for communication
-            clientDataStruct newClientStruct = {predecessorFD};
-            pthread_create(&thread, NULL, messageHandler, (void *)&newClientStruct);
-            pthread_detach(thread);
-            write(predecessorFD, "ack", strlen("ack"));
+            sendMessage(memberFD, message, strlen(message));
+            close(memberFD);
+
+            // The node owning our id connects back to us and handle_connections picks up the entered message.
         } // enter
-        else if (strcmp("exit", command) == 0) // TODO: Currently CRASHES. Don't.
+        else if (strcmp("exit", command) == 0)
         {
             /*
             the name server will gracefully exit the system. The name server will inform its
             successor and predecessor name servers. It will hand over the key value pairs that it was
             maintaining to the successor. Upon successful exit, the server will print �Successful exit�
             message. It will also print out the ID of the successor and the key range that was handed over
+
+            The process stays up after exiting and keeps its copy of the keys, so a later enter
+            only has to sync the keys that changed while it was away.
             */
 
-            running = 0;
-            write(successorFD, "getID", strlen("getID"));
-            readAmount = read(successorFD, inputBuffer, BUFFER_SIZE);
-            inputBuffer[readAmount] = '\0';
+            if (!inRing)
+            {
+                printf("Not in the ring\n");
+                continue;
+            }
+            pthread_mutex_lock(&rangeLock);
+
+            // Our own connection for the handover, successorFD carries forwarded requests
+            int handoverFD = create_connection(successorAddress, successorPort);
+            if (handoverFD < 0)
+            {
+                printf("Can't reach successor\n");
+                pthread_mutex_unlock(&rangeLock);
+                continue;
+            }
+            sendMessage(handoverFD, "getID", strlen("getID"));
+            readMessage(handoverFD, inputBuffer);
             int id;
             sscanf(inputBuffer, "%d", &id);
 
+            // give my key values to successor
+            // We keep serving the range while it is copied, forwarding writes to the successor as they happen.
+            beginMigration(range[0], range[1], successorAddress, successorPort);
+            sendMessage(handoverFD, "syncRange", strlen("syncRange"));
+            if (sendRange(handoverFD, range[0], range[1]) < 0)
+            {
+                endMigration();
+                close(handoverFD);
+                pthread_mutex_unlock(&rangeLock);
+                printf("Exit failed, successor went away\n");
+                continue;
+            }
+
             // tell successor to inherit my range
+            // Writes to the range are held while anything the forwarding missed is synced.
+            // We only leave once the successor acks that it has all of it.
+            pthread_rwlock_wrlock(&ownershipLock);
             char message02[BUFFER_SIZE];
             snprintf(message02, sizeof(message02), "updateRange0 %d", range[0]);
-            write(successorFD, message02, strlen(message02));
-
-            // give my key values to successor
-            for (int i = range[0]; i <= range[1]; i++)
+            if (sendMessage(handoverFD, message02, strlen(message02)) < 0 || sendRange(handoverFD, range[0], range[1]) < 0 ||
+                readMessage(handoverFD, inputBuffer) <= 0 || strcmp(inputBuffer, "ack") != 0)
             {
-                if (values[i] != NULL)
-                {
-                    char insertMessage[BUFFER_SIZE];
-                    snprintf(insertMessage, sizeof(insertMessage), "%d %s ", i, values[i]);
-                    write(successorFD, insertMessage, strlen(insertMessage));
-                    delete(i);
-                }
+                endMigration();
+                pthread_rwlock_unlock(&ownershipLock);
+                close(handoverFD);
+                pthread_mutex_unlock(&rangeLock);
+                printf("Exit failed, successor didn't take over [%d, %d]\n", range[0], range[1]);
+                continue;
             }
-            write(successorFD, "EOF", strlen("EOF"));
-
-            // tell successor its new predecessor is my predecessor
-            char message03[BUFFER_SIZE];
-            snprintf(message03, sizeof(message03), "updatePredecessor %d %s", predecessorPort, predecessorAddress);
-            write(successorFD, message03, strlen(message03));
+            // From here on we pass everything we get on to the successor
+            inRing = 0;
+            endMigration();
+            pthread_rwlock_unlock(&ownershipLock);
 
             // tell predecessor its new successor is my successor
             char message01[BUFFER_SIZE];
             snprintf(message01, sizeof(message01), "updateSuccessor %d %s", successorPort, successorAddress);
-            write(predecessorFD, message01, strlen(message01));
+            sendMessage(predecessorFD, message01, strlen(message01));
+            readMessage(predecessorFD, inputBuffer);
+
+            // tell successor its new predecessor is my predecessor
+            char message03[BUFFER_SIZE];
+            snprintf(message03, sizeof(message03), "updatePredecessor %d %s", predecessorPort, predecessorAddress);
+            sendMessage(handoverFD, message03, strlen(message03));
 
+            // successorFD stays open so requests our predecessor sent before switching still get passed on
+            close(handoverFD);
             close(predecessorFD);
-            close(successorFD);
-            close(bootstrapFD);
-            // Stops the messageHandler thread.
-            pthread_cancel(thread);
+            pthread_mutex_unlock(&rangeLock);
+            // Our messageHandler threads stop once our neighbours close their connections to us.
 
             // print id of my successor and range of keys handed over
             printf("Successful exit\n");
             printf("ID of successor: %d\n", id);
             printf("Range of keys handed over: [%d, %d]\n", range[0], range[1]);
         } // exit
+        else if (strcmp("lookup", command) == 0 || strcmp("insert", command) == 0 || strcmp("delete", command) == 0)
+        {
+            clientCommand(command, inputBuffer, 0);
+        }
+        else if (strcmp("batch", command) == 0)
+        {
+            batchCommand(inputBuffer);
+        }
+        else if (strcmp("hedge", command) == 0 || strcmp("deadline", command) == 0)
+        {
+            tuneCommand(command, inputBuffer);
+        }
+        else if (strcmp("dump", command) == 0 || strcmp("import", command) == 0)
+        {
+            bulkCommand(command, inputBuffer);
+        }
+        else if (strcmp("stats", command) == 0)
+        {
+            printStats();
+        } // stats
     }
 }
 
 // Handles all incoming connections by creating a new thread to accept them.
-void handle_connections()
+// Every node runs this, so any node can be joined through and reached by its neighbours.
+void *handle_connections(void *arg)
 {
     struct sockaddr_in clientAddr;
     socklen_t clientAddrlen = sizeof(clientAddr);
@@ -826,9 +3237,11 @@ void handle_connections()
         write(1, "Node Connected to Port\n", sizeof("Node Connected to Port\n"));
 
         // Spins off a new thread to handle all the client commands
-        clientDataStruct newClientStruct = {clientDataFD};
+        // The thread frees the struct once it has read the fd out of it.
+        clientDataStruct *newClientStruct = (clientDataStruct *)malloc(sizeof(clientDataStruct));
+        newClientStruct->fd = clientDataFD;
         pthread_t thread;
-        pthread_create(&thread, NULL, messageHandler, (void *)&newClientStruct);
+        pthread_create(&thread, NULL, messageHandler, (void *)newClientStruct);
         pthread_detach(thread);
     }
 }
@@ -839,12 +3252,23 @@ int main(int argc, char *argv[])
     setbuf(stdout, NULL);
 
     // Makes sure that there are enough and not too many arguments
-    if (argc != 2)
+    if (argc != 2 && argc != 3)
     {
-        printf("Usage: ./nameserver <Config File>\n");
+        printf("Usage: ./nameserver <Config File> [Memory Budget Bytes]\n");
         return EXIT_FAILURE;
     }
 
+    // The optional memory budget caps the key and value bytes this node holds
+    if (argc == 3)
+    {
+        memoryBudget = strtoul(argv[2], NULL, 10);
+        if (memoryBudget == 0)
+        {
+            printf("Invalid memory budget\n");
+            return EXIT_FAILURE;
+        }
+    }
+
     // Open the file for reading
     FILE *file = fopen(argv[1], "r");
     if (file == NULL)
@@ -862,12 +3286,50 @@ int main(int argc, char *argv[])
 
     // More general nameserver setup stuff:
     socketFD = open_socket(port);
+    if (get_local_ip(myIP) != 0)
+    {
+        return EXIT_FAILURE;
+    }
 
     // Initialize the space to hold all the values with NULL
     for (int i = 0; i < HASH_SPACE; i++)
     {
         values[i] = NULL;
+        referenced[i] = 0;
+        expiresAt[i] = 0;
+        expiryStamp[i] = 0;
+        timerNext[i] = -1;
+        timerPrev[i] = -1;
+        timerSlot[i] = -1;
+        hits[i] = 0;
     }
+    for (int i = 0; i < WHEEL_LEVELS * WHEEL_SLOTS; i++)
+    {
+        wheel[i] = -1;
+    }
+
+    // Expires keys in the background
+    pthread_t expiryThread;
+    pthread_create(&expiryThread, NULL, expiryMain, NULL);
+    pthread_detach(expiryThread);
+
+    // A dead neighbour shows up as a failed write, which must not kill us
+    signal(SIGPIPE, SIG_IGN);
+
+    // Watches our successor and fails over when it dies
+    pthread_t heartbeatThread;
+    pthread_create(&heartbeatThread, NULL, heartbeatMain, NULL);
+    pthread_detach(heartbeatThread);
+
+    // Hedges slow requests and gives up on ones past their deadline
+    pthread_t hedgeThread;
+    pthread_create(&hedgeThread, NULL, hedgeMain, NULL);
+    pthread_detach(hedgeThread);
+
+    // Moves load off this node when it gets much hotter than its successor
+    pthread_t rebalanceThread;
+    pthread_create(&rebalanceThread, NULL, rebalanceMain, NULL);
+    pthread_detach(rebalanceThread);
 
     if (range[1] != 0)
     {
@@ -875,6 +3337,12 @@ int main(int argc, char *argv[])
         // We get the bootstrap details from the config
         fscanf(file, "%s %d", bootstrapAddress, &bootstrapPort);
         fclose(file);
+
+        // This handles commands coming in from other name servers
+        pthread_t thread;
+        pthread_create(&thread, NULL, handle_connections, NULL);
+        pthread_detach(thread);
+
         // We'll get range[0] later when we figure out our place.
         // Call the user thread handler for the nameserver
         nameServerMain();
@@ -886,10 +3354,9 @@ int main(int argc, char *argv[])
         // Since the bootstrap is always the first, it's intitial range
         // is always from [1, 0]. ( It loops, 1,2,...,1023,0 )
         range[0] = 1;
+        inRing = 1;
 
         // bootstrap predecessor and successor start as itself
-        char myIP[INET_ADDRSTRLEN]; // INET_ADDRSTRLEN = 16 bytes, enough for IPv4 string
-        get_local_ip(myIP);
         strcpy(predecessorAddress, myIP);
         strcpy(successorAddress, myIP);
         predecessorPort = port;
@@ -898,13 +3365,23 @@ int main(int argc, char *argv[])
         snprintf(bootstrapAddress, sizeof(bootstrapAddress), "%s", myIP);
         bootstrapPort = port;
         
-        int key;
-        char value[BUFFER_SIZE];
-        while (fscanf(file, "%d %s", &key, value) != EOF)
+        // The rest of the config holds "key value [ttl]" records, the same format dump writes
+        long offset = ftell(file);
+        fclose(file);
+        size_t fileLength;
+        char *data = mapFile(argv[1], &fileLength);
+        if (data != NULL)
         {
-            insert(key, value);
+            char *cursor = data + offset;
+            int key;
+            char value[BUFFER_SIZE];
+            unsigned long ttl;
+            while (parseRecord(&cursor, data + fileLength, &key, value, &ttl))
+            {
+                insert(key, value, ttl);
+            }
+            munmap(data, fileLength);
         }
-        fclose(file);
         // This handles commands coming in from other name servers
         pthread_t thread;
         pthread_create(&thread, NULL, handle_connections, NULL);